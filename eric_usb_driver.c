@@ -10,6 +10,9 @@
  * This driver is based on the 2.6.3 version of drivers/usb/usb-skeleton.c
  * but has been rewritten to be easier to read and use.
  *
+ * Builds against Linux 6.6, the USB, block and iov_iter interfaces it
+ * uses are the ones of that release.
+ *
  */
 
 #include <linux/kernel.h>
@@ -21,16 +24,54 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/idr.h>
+#include <linux/timer.h>
+#include <linux/usb/storage.h>
+#include <linux/usb/uas.h>
+#include <scsi/scsi_proto.h>
+#include <asm/unaligned.h>
+
+#include "eric_usb_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "eric_usb_trace.h"
 
 
 /* Define these values to match your devices */
 #define USB_SKEL_VENDOR_ID	0x1234
 #define USB_SKEL_PRODUCT_ID	0x5678
 
+/* driver_info flag: a mass-storage interface, served as a disk */
+#define SKEL_BOT		0x1
+
 //USB_DEVICE是一個MACRO，定義在usb.h中，幫助建立一個 usb_device_id
 /* table of devices that work with this driver */
 static const struct usb_device_id skel_table[] = {
 	{ USB_DEVICE(USB_SKEL_VENDOR_ID, USB_SKEL_PRODUCT_ID) },
+	/* SCSI over the Bulk-Only Transport, what usb-storage would take */
+	{ USB_INTERFACE_INFO(USB_CLASS_MASS_STORAGE, USB_SC_SCSI, USB_PR_BULK),
+	  .driver_info = SKEL_BOT },
+	/* and USB Attached SCSI, spoken where streams are available */
+	{ USB_INTERFACE_INFO(USB_CLASS_MASS_STORAGE, USB_SC_SCSI, USB_PR_UAS),
+	  .driver_info = SKEL_BOT },
 	{ }					/* Terminating entry */
 };
 
@@ -43,49 +84,475 @@ MODULE_DEVICE_TABLE(usb, skel_table);
 #define USB_SKEL_MINOR_BASE	192
 
 /* our private defines. if this grows any larger, use your own .h file */
-#define MAX_TRANSFER		(PAGE_SIZE - 512)
-/* MAX_TRANSFER is chosen so that the VM is not stressed by
-   allocations > PAGE_SIZE and the number of packets in a page
-   is an integer 512 is the largest possible packet on EHCI */
 #define WRITES_IN_FLIGHT	8
-/* arbitrarily chosen */
+/* the write window a device starts with */
+#define WRITES_IN_FLIGHT_MAX	32
+/* hard and default upper bound of the write window */
+#define WRITE_WINDOW_QUEUE	3
+/* urbs queued beyond the latency floor before the window shrinks */
+#define WRITE_WINDOW_ROUNDS	16
+/* rounds after which the latency floor is measured again */
+#define WRITE_DIRECT_MAX	(4 * 1024 * 1024)
+/* largest urb sent straight from the caller's pages */
+#define READ_URBS_MAX		32
+/* upper bound for the read_urbs parameter */
+#define READ_SIZE_MIN		(16 * 1024)
+#define READ_SIZE_MAX		(4 * 1024 * 1024)
+#define READ_LINEAR_MAX		(128 * 1024)
+#define READ_PAGES(dev)		DIV_ROUND_UP((dev)->bulk_in_size, PAGE_SIZE)
+/* hosts without scatter-gather get one physically contiguous buffer,
+   keep that small enough to be found in a fragmented system */
+#define SKEL_BOT_TIMEOUT	(20 * HZ)
+/* a mass-storage command that takes longer is aborted */
+#define SKEL_BOT_ZERO_TIMEOUT	(120 * HZ)
+/* the same for WRITE SAME and UNMAP, which may cover the whole disk */
+#define SKEL_BOT_RETRIES	3
+/* tries for a command that reports a unit attention */
+#define SKEL_BOT_SEGS		256
+/* most segments in one mass-storage request */
+#define SKEL_BOT_BUF		64
+#define SKEL_BOT_SENSE_LEN	18
+/* our own commands' data, fixed format sense */
+#define SKEL_UAS_STREAMS	256
+/* deepest UAS queue, one stream per tag */
+#define SKEL_UNMAP_LEN		24
+/* UNMAP parameter list with one block descriptor */
+#define SKEL_WS16_BLOCKS	0x7fffff
+#define SKEL_WS10_BLOCKS	0xffff
+/* most blocks per WRITE SAME if the device doesn't say */
+
+static unsigned int bot_max_sectors = 2048;
+module_param(bot_max_sectors, uint, 0444);
+MODULE_PARM_DESC(bot_max_sectors, "largest mass-storage transfer in 512 byte sectors, for devices that don't report one");
+
+static unsigned int read_urbs = 4;
+module_param(read_urbs, uint, 0444);
+MODULE_PARM_DESC(read_urbs, "number of bulk-in urbs kept queued for readers (1-32)");
+
+static unsigned int read_size = 64 * 1024;
+module_param(read_size, uint, 0444);
+MODULE_PARM_DESC(read_size, "bytes per bulk-in urb (16KiB-4MiB)");
+
+static unsigned int write_size = 64 * 1024;
+module_param(write_size, uint, 0444);
+MODULE_PARM_DESC(write_size, "bytes per bulk-out urb of copying writes (4KiB-128KiB)");
+
+static unsigned int write_behind;
+module_param(write_behind, uint, 0444);
+MODULE_PARM_DESC(write_behind, "bytes of copied writes queued behind a full write window before write() blocks (0 = off)");
+
+static unsigned int coalesce_size;
+module_param(coalesce_size, uint, 0644);
+MODULE_PARM_DESC(coalesce_size, "collect smaller writes into one urb until this many bytes are pending (0 = off)");
+
+static unsigned int coalesce_usecs = 2000;
+module_param(coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(coalesce_usecs, "longest time collected writes wait for more data");
+
+static unsigned int irq_batch;
+module_param(irq_batch, uint, 0644);
+MODULE_PARM_DESC(irq_batch, "let only every Nth queued urb raise a completion interrupt (0/1 = every urb)");
+
+static unsigned int irq_batch_usecs = 500;
+module_param(irq_batch_usecs, uint, 0644);
+MODULE_PARM_DESC(irq_batch_usecs, "how long a read completion may go unreported before it is fetched");
+
+static unsigned int direct_read_min = 64 * 1024;
+module_param(direct_read_min, uint, 0644);
+MODULE_PARM_DESC(direct_read_min, "smallest O_DIRECT read done into the caller's pages");
+
+static unsigned int direct_write_min = 64 * 1024;
+module_param(direct_write_min, uint, 0644);
+MODULE_PARM_DESC(direct_write_min, "smallest write sent from the caller's pinned pages");
+
+static unsigned int aio_depth = 64;
+module_param(aio_depth, uint, 0644);
+MODULE_PARM_DESC(aio_depth, "asynchronous (AIO, io_uring) transfers outstanding per device");
+
+struct usb_skel;
+
+enum { SKEL_IN, SKEL_OUT };
+
+/* urb status codes counted apart, everything else is SKEL_ERR_OTHER */
+enum {
+	SKEL_ERR_SUBMIT,		/* usb_submit_urb() failed */
+	SKEL_ERR_UNLINK,		/* -ENOENT, -ECONNRESET */
+	SKEL_ERR_SHUTDOWN,		/* -ESHUTDOWN, -ENODEV */
+	SKEL_ERR_EPIPE,
+	SKEL_ERR_EPROTO,
+	SKEL_ERR_EILSEQ,
+	SKEL_ERR_ETIME,
+	SKEL_ERR_EOVERFLOW,
+	SKEL_ERR_EREMOTEIO,
+	SKEL_ERR_OTHER,
+	SKEL_ERR_MAX
+};
+
+/* bucket 0 is below 1us, bucket i up to 2^i us, the last one open ended */
+#define SKEL_LAT_BUCKETS	24
+
+/* Counters of one CPU, debugfs adds them up */
+struct skel_stats {
+	u64			bytes[2];		/* transferred, SKEL_IN and SKEL_OUT */
+	u64			urbs[2];		/* completed */
+	u64			short_xfers[2];		/* completed with less than asked for */
+	u64			errors[SKEL_ERR_MAX];
+	u64			eagain;			/* -EAGAIN handed to callers */
+	u64			read_kicks;		/* stalled batches fetched by the timer */
+	u64			submit_lat[SKEL_LAT_BUCKETS];	/* submission to completion */
+	u64			wake_lat[SKEL_LAT_BUCKETS];	/* completion to reader */
+};
+
+/* One entry of the bulk-in ring */
+struct skel_read_slot {
+	struct usb_skel		*dev;			/* the device this slot belongs to */
+	struct urb		*urb;			/* the urb to read data with */
+	unsigned char		*buffer;		/* contiguous receive buffer, or NULL */
+	struct scatterlist	*sg;			/* one page per entry, or NULL */
+	size_t			filled;			/* number of bytes in the buffer */
+	size_t			copied;			/* already copied to user space */
+	int			status;			/* completion status of the urb */
+	ktime_t			submitted;		/* when the urb went out */
+	ktime_t			completed;		/* when it came back, until a reader saw it */
+	bool			kicked;			/* unlinked by skel_read_kick() */
+	bool			cut;			/* the unlink ended it mid-transfer */
+};
+
+/* A transfer into or out of the caller's memory, synchronous or not */
+struct skel_dio {
+	struct usb_skel		*dev;			/* the device this transfer belongs to */
+	struct kiocb		*iocb;			/* completed by the callback, or NULL */
+	struct urb		*urb;
+	struct scatterlist	*sg;			/* the caller's pages */
+	struct page		**pages;
+	unsigned int		nr_pages;
+	bool			unpin;			/* the pages were pinned by us */
+	bool			dirty;			/* the device wrote into them */
+	void			*bounce;		/* coherent copy of the data, or NULL */
+	size_t			len;			/* the size of the bounce buffer */
+	struct completion	done;			/* for synchronous callers */
+	struct llist_node	reap;			/* to free it from process context */
+	ktime_t			submitted;		/* when the urb went out */
+	ktime_t			completed;		/* when it came back */
+};
+
+/* A bulk-out urb with its coherent buffer, kept for the life of the device */
+struct skel_write_buf {
+	struct usb_skel		*dev;			/* the device this buffer belongs to */
+	struct urb		*urb;			/* set up once, only the length changes */
+	void			*buffer;		/* bulk_out_size bytes */
+	struct llist_node	node;			/* in write_pool while idle */
+	struct llist_node	all;			/* in write_bufs, for freeing */
+	struct list_head	queue;			/* in behind, waiting for a write slot */
+	size_t			len;			/* bytes to send from it */
+	ktime_t			submitted;		/* when the urb went out */
+};
+
+/*
+ * The number of writes kept in flight, sized from completions like a
+ * bandwidth-delay product, see skel_window_sample()
+ */
+struct skel_write_window {
+	spinlock_t		lock;
+	unsigned int		size;			/* write slots, min <= size <= max */
+	unsigned int		min;
+	unsigned int		max;
+	bool			limited;		/* writers ran into the window this round */
+	ktime_t			start;			/* of the current round */
+	unsigned int		urbs;			/* completed this round */
+	unsigned int		batched;		/* completed without an interrupt, not yet counted */
+	u64			lat_sum;		/* their latencies, in ns */
+	u64			round_min;		/* the shortest of them */
+	u64			lat_min;		/* the latency floor */
+	unsigned int		rounds;			/* since lat_min was measured */
+};
 
 /* Structure to hold all of our device specific stuff */
 struct usb_skel {
 	struct usb_device	*udev;			/* the usb device for this device */
 	struct usb_interface	*interface;		/* the interface for this device */
-	struct semaphore	limit_sem;		/* limiting the number of writes in progress */
+	struct skel_write_window wwin;			/* limiting the number of writes in progress */
+	atomic_t		writes_in_flight;	/* write slots taken */
+	atomic_t		writes_peak;		/* most slots ever taken at once */
+	unsigned int		write_sent;		/* bulk-out urbs submitted, under io_mutex */
+	atomic_t		write_done;		/* bulk-out urbs completed */
+	struct llist_head	write_bufs;		/* all of them, as many as slots were needed */
+	struct llist_head	write_pool;		/* the idle ones */
+	spinlock_t		write_pool_lock;	/* serializes taking from write_pool */
+	struct skel_write_buf	*pending;		/* collecting small writes, or NULL */
+	size_t			pending_len;		/* bytes collected in it */
+	struct mutex		pending_mutex;		/* protects pending */
+	struct delayed_work	pending_work;		/* sends it when coalesce_usecs pass */
+	struct list_head	behind;			/* filled buffers waiting for a write slot */
+	spinlock_t		behind_lock;		/* protects behind */
+	struct mutex		behind_mutex;		/* serializes sending from it */
+	unsigned int		behind_in;		/* buffers ever queued, under behind_lock */
+	unsigned int		behind_out;		/* buffers ever sent, under behind_mutex */
+	struct work_struct	behind_work;		/* sends from it as slots come free */
+	atomic_t		behind_nr;		/* buffers queued or being filled for it */
+	unsigned int		behind_max;		/* limit of behind_nr, 0 without write_behind */
 	struct usb_anchor	submitted;		/* in case we need to retract our submissions */
-	struct urb		*bulk_in_urb;		/* the urb to read data with */
-	unsigned char           *bulk_in_buffer;	/* the buffer to receive data */
-	size_t			bulk_in_size;		/* the size of the receive buffer */
-	size_t			bulk_in_filled;		/* number of bytes in the buffer */
-	size_t			bulk_in_copied;		/* already copied to user space */
+	struct usb_anchor	read_submitted;		/* bulk-in urbs owned by the host controller */
+	struct skel_read_slot	*read_slots;		/* ring of bulk-in urbs */
+	unsigned int		read_nr;		/* number of slots in the ring */
+	unsigned int		read_posted;		/* slots submitted so far */
+	unsigned int		read_done;		/* slots completed so far */
+	unsigned int		read_consumed;		/* slots drained by readers so far */
+	bool			read_running;		/* keep the ring queued */
+	bool			read_irq_always;	/* no batching, nothing is arriving */
+	struct hrtimer		read_kick;		/* fetches a batch the device left unfinished */
+	unsigned int		read_kick_seq;		/* read_done when read_kick was armed */
+	atomic_t		write_seq;		/* copying write urbs sent, for irq_batch */
+	struct skel_ring_ctrl	*ring_ctrl;		/* control page of the mmap()ed ring */
+	unsigned int		read_mapped;		/* vmas mapping the ring */
+	bool			read_syscall;		/* read() consumes the ring, no mmap() */
+	size_t			bulk_in_size;		/* the size of each receive buffer */
+	size_t			bulk_in_maxp;		/* the packet size of the bulk in endpoint */
+	size_t			bulk_out_maxp;		/* the packet size of the bulk out endpoint */
 	__u8			bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
 	__u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
+	size_t			bulk_out_size;		/* the size of each write buffer */
+	int			minor;			/* N of /dev/skelN, for the trace events */
 	int			errors;			/* the last request tanked */
 	int			open_count;		/* count the number of openers */
-	bool			ongoing_read;		/* a read is going on */
-	bool			processed_urb;		/* indicates we haven't processed the urb */
-	spinlock_t		err_lock;		/* lock for errors */
+	spinlock_t		err_lock;		/* lock for write errors */
+	spinlock_t		read_lock;		/* lock for the read ring */
 	struct kref		kref;
 	struct mutex		io_mutex;		/* synchronize I/O with disconnect */
-	struct completion	bulk_in_completion;	/* to wait for an ongoing read */
+	struct mutex		read_mutex;		/* serializes readers, never held by writers */
+	wait_queue_head_t	bulk_in_wait;		/* to wait for a completed read */
+	wait_queue_head_t	bulk_out_wait;		/* to wait for a free write slot */
+	atomic_t		aio_in_flight;		/* asynchronous transfers outstanding */
+	wait_queue_head_t	aio_wait;		/* to wait for aio_in_flight to drop */
+	struct llist_head	dio_reap;		/* finished asynchronous transfers */
+	struct work_struct	dio_work;		/* frees them */
+	struct skel_stats __percpu *stats;
+	struct dentry		*debugfs;		/* our directory below skel_debugfs_root */
+	struct skel_bot		*bot;			/* mass storage, or NULL */
 };
 #define to_skel_dev(d) container_of(d, struct usb_skel, kref)
 
+/* What each open file of the device keeps for itself */
+struct skel_file {
+	struct usb_skel		*dev;
+	unsigned int		mode;			/* SKEL_MODE_*, see eric_usb_ioctl.h */
+	struct skel_msg_info	msg;			/* about the last message read */
+};
+
+static struct usb_skel *skel_file_dev(struct file *file)
+{
+	struct skel_file *sf = file->private_data;
+
+	return sf ? sf->dev : NULL;
+}
+
+static bool skel_msg_mode(struct file *file)
+{
+	struct skel_file *sf = file->private_data;
+
+	return READ_ONCE(sf->mode) == SKEL_MODE_MSG;
+}
+
+/* How a unit is told that blocks are no longer used */
+enum { SKEL_DISCARD_NONE, SKEL_DISCARD_UNMAP, SKEL_DISCARD_WS };
+
+/* A logical unit of a mass-storage device, one disk each */
+struct skel_lun {
+	struct skel_bot		*bot;
+	struct blk_mq_tag_set	tag_set;		/* depth one for BOT, streams for UAS */
+	struct gendisk		*disk;			/* NULL if the unit isn't used */
+	int			index;			/* N of the skelbN disk */
+	u8			lun;
+	bool			read_only;
+	bool			removable;		/* the medium may come and go */
+	bool			ready;			/* a medium is in, by the last TEST UNIT READY */
+	unsigned int		block_shift;		/* log2 of the logical block size */
+	sector_t		blocks;			/* capacity in logical blocks */
+	bool			vpd;			/* SPC-3 or later, VPD pages may be asked for */
+	/* from the Block Limits VPD page in logical blocks, 0 if not reported */
+	u32			max_xfer;
+	u32			opt_xfer;
+	u16			opt_gran;
+	u32			max_unmap;
+	u32			unmap_gran;
+	u64			max_ws;
+	/* from the Logical Block Provisioning VPD page */
+	u8			discard;		/* SKEL_DISCARD_*, how it's sent */
+	bool			write_same;		/* WRITE ZEROES as WRITE SAME */
+	bool			ws10;			/* only WRITE SAME(10) is known */
+};
+
+/* What the Bulk-Only Transport is busy with */
+enum { SKEL_BOT_IDLE, SKEL_BOT_URB, SKEL_BOT_SG };
+
+/* The urbs of one UAS command */
+enum { SKEL_UAS_STATUS, SKEL_UAS_DATA, SKEL_UAS_CMD, SKEL_UAS_URBS };
+
+/*
+ * Transport to a mass-storage device: Bulk-Only, one command at a time,
+ * or UAS, as many as there are streams
+ */
+struct skel_bot {
+	struct usb_skel		*dev;
+	struct workqueue_struct	*wq;			/* runs the BOT commands of all units */
+	struct mutex		mutex;			/* held for a whole command */
+	struct urb		*urb;			/* for CBW and CSW */
+	void			*iobuf;			/* CBW and CSW, DMA-able */
+	u8			*buf;			/* data of our own commands */
+	struct mutex		buf_mutex;		/* held while one of them uses buf */
+	u8			*sense;			/* REQUEST SENSE data, under mutex */
+	struct usb_sg_request	sg;			/* the data stage */
+	struct completion	done;			/* urb came back */
+	struct timer_list	timer;			/* aborts a command that hangs */
+	spinlock_t		lock;			/* protects stage and aborted */
+	int			stage;			/* SKEL_BOT_*, what to cancel */
+	bool			aborted;		/* the command in progress must stop */
+	bool			dead;			/* disconnect() was called */
+	bool			stopped;		/* suspended or in reset, set under mutex */
+	u32			tag;			/* of the last CBW */
+	u8			ifnum;			/* for the class reset */
+	unsigned int		segs;			/* sg entries per request */
+	struct skel_lun		*luns;
+	unsigned int		nr_luns;
+	bool			uas;			/* speaks UAS, not BOT */
+	unsigned int		uas_pipe[DATA_OUT_PIPE_ID + 1];	/* by UAS pipe ID */
+	struct usb_host_endpoint *uas_eps[3];		/* status, data in and out */
+	unsigned int		streams;		/* allocated on each of uas_eps */
+	struct usb_anchor	uas_submitted;		/* urbs of running UAS commands */
+	struct work_struct	reset_work;		/* after a UAS command timed out */
+};
+
+/* blk-mq's per request data */
+struct skel_bot_cmd {
+	struct work_struct	work;			/* BOT */
+	struct urb		*urbs[SKEL_UAS_URBS];	/* UAS from here on */
+	struct command_iu	*iu;
+	struct sense_iu		*sense;
+	atomic_t		pending;		/* urbs not yet back */
+	int			status;			/* first urb error */
+	unsigned int		retries;
+	u8			cdb[16];		/* of a REQ_OP_DRV_IN */
+	int			result;			/* its sense key or error */
+	unsigned int		len;			/* bytes in the data stage */
+	u8			param[SKEL_UNMAP_LEN];	/* only ever sent, may share cache lines */
+	struct scatterlist	sg[];
+};
+
 static struct usb_driver skel_driver;
-static void skel_draw_down(struct usb_skel *dev);
+static int skel_draw_down(struct usb_skel *dev);
+static void skel_read_stop(struct usb_skel *dev);
+static int skel_read_refill(struct usb_skel *dev);
+static void skel_write_flush_pending(struct usb_skel *dev);
+static void skel_write_slot_put(struct usb_skel *dev);
+static struct dentry *skel_debugfs_root;
+static DEFINE_IDA(skel_bot_ida);
+static void skel_bot_free(struct skel_bot *bot);
+
+static unsigned int skel_err_bucket(int status)
+{
+	switch (status) {
+	case -ENOENT:
+	case -ECONNRESET:
+		return SKEL_ERR_UNLINK;
+	case -ESHUTDOWN:
+	case -ENODEV:
+		return SKEL_ERR_SHUTDOWN;
+	case -EPIPE:
+		return SKEL_ERR_EPIPE;
+	case -EPROTO:
+		return SKEL_ERR_EPROTO;
+	case -EILSEQ:
+		return SKEL_ERR_EILSEQ;
+	case -ETIME:
+		return SKEL_ERR_ETIME;
+	case -EOVERFLOW:
+		return SKEL_ERR_EOVERFLOW;
+	case -EREMOTEIO:
+		return SKEL_ERR_EREMOTEIO;
+	}
+	return SKEL_ERR_OTHER;
+}
+
+static unsigned int skel_lat_bucket(ktime_t since)
+{
+	s64 us = ktime_us_delta(ktime_get(), since);
+
+	if (us <= 0)
+		return 0;
+	return min_t(unsigned int, ilog2(us) + 1, SKEL_LAT_BUCKETS - 1);
+}
+
+/* account a finished urb, submitted is zero if nobody took the time */
+static void skel_stat_urb(struct usb_skel *dev, struct urb *urb,
+			  ktime_t submitted)
+{
+	int dir = usb_urb_dir_in(urb) ? SKEL_IN : SKEL_OUT;
+
+	this_cpu_inc(dev->stats->urbs[dir]);
+	this_cpu_add(dev->stats->bytes[dir], urb->actual_length);
+	if (urb->status)
+		this_cpu_inc(dev->stats->errors[skel_err_bucket(urb->status)]);
+	else if (urb->actual_length < urb->transfer_buffer_length)
+		this_cpu_inc(dev->stats->short_xfers[dir]);
+	if (submitted)
+		this_cpu_inc(dev->stats->submit_lat[skel_lat_bucket(submitted)]);
+}
+
+/* what a syscall returns, counting -EAGAIN on the way */
+static long skel_stat_ret(struct usb_skel *dev, long rv)
+{
+	if (rv == -EAGAIN)
+		this_cpu_inc(dev->stats->eagain);
+	return rv;
+}
+
+
+static struct page *skel_slot_page(struct usb_skel *dev,
+				   struct skel_read_slot *slot, unsigned int i)
+{
+	if (slot->sg)
+		return sg_page(&slot->sg[i]);
+	return virt_to_page(slot->buffer + i * PAGE_SIZE);
+}
+
+static void skel_free_read_slots(struct usb_skel *dev)
+{
+	struct skel_read_slot *slot;
+	unsigned int i, j;
+
+	if (!dev->read_slots)
+		return;
+
+	for (i = 0; i < dev->read_nr; i++) {
+		slot = &dev->read_slots[i];
+		usb_free_urb(slot->urb);
+		if (slot->sg) {
+			for (j = 0; j < READ_PAGES(dev); j++)
+				if (sg_page(&slot->sg[j]))
+					__free_page(sg_page(&slot->sg[j]));
+			kfree(slot->sg);
+		} else if (slot->buffer) {
+			free_pages_exact(slot->buffer, dev->bulk_in_size);
+		}
+	}
+	kfree(dev->read_slots);
+}
 
+static void skel_free_write_buf(struct usb_skel *dev, struct skel_write_buf *wb)
+{
+	if (wb->buffer)
+		usb_free_coherent(dev->udev, dev->bulk_out_size, wb->buffer,
+				  wb->urb->transfer_dma);
+	usb_free_urb(wb->urb);
+	kfree(wb);
+}
 
-static void showEndPoint(const struct usb_endpoint_descriptor *endpoint)
+static void skel_free_write_bufs(struct usb_skel *dev)
 {
-	printk(KERN_ERR "ep->bLength=%x\n", endpoint->bLength);
-	printk(KERN_ERR "ep->bDescriptorType=%x\n", endpoint->bDescriptorType);
-	printk(KERN_ERR "ep->bEndpointAddress=%x\n", endpoint->bEndpointAddress);
-	printk(KERN_ERR "ep->bmAttributes=%x\n", endpoint->bmAttributes);
-	printk(KERN_ERR "ep->wMaxPacketSize=%x\n", endpoint->wMaxPacketSize);
-	printk(KERN_ERR "ep->bInterval=%x\n", endpoint->bInterval);
+	struct skel_write_buf *wb, *next;
+
+	llist_for_each_entry_safe(wb, next, dev->write_bufs.first, all)
+		skel_free_write_buf(dev, wb);
 }
 
 static void skel_delete(struct kref *kref)
@@ -97,14 +564,20 @@ static void skel_delete(struct kref *kref)
 	3.釋放分配的數據空間
 	4.釋放分配的驅動空間
 	*/
-	printk(KERN_ERR "==eric_delete==\n");
-
 	struct usb_skel *dev = to_skel_dev(kref);
 
-	usb_free_urb(dev->bulk_in_urb);
-	usb_put_dev(dev->udev);
+	cancel_delayed_work_sync(&dev->pending_work);
+	cancel_work_sync(&dev->behind_work);
+	hrtimer_cancel(&dev->read_kick);
 	//釋放批量輸入端口緩衝
-	kfree(dev->bulk_in_buffer);
+	skel_free_read_slots(dev);
+	skel_free_write_bufs(dev);
+	/* a mapping that outlives us keeps its own page references */
+	free_page((unsigned long)dev->ring_ctrl);
+	free_percpu(dev->stats);
+	if (dev->bot)
+		skel_bot_free(dev->bot);
+	usb_put_dev(dev->udev);
 	//釋放設備
 	kfree(dev);
 }
@@ -112,21 +585,19 @@ static void skel_delete(struct kref *kref)
 
 static int skel_open(struct inode *inode, struct file *file)
 {
+	struct skel_file *sf;
 	struct usb_skel *dev;
 	struct usb_interface *interface;
 	int subminor;
 	int retval = 0;
 
-	printk(KERN_INFO "==eric_open==\n");
 	subminor = iminor(inode);
 
-	printk(KERN_ERR "subminor=%d\n", subminor);
-
 	// 藉由subminor號，取出對應的interface
 	interface = usb_find_interface(&skel_driver, subminor);
 	if (!interface) {
-		err("%s - error, can't find device for minor %d",
-		     __func__, subminor);
+		pr_err("%s - error, can't find device for minor %d\n",
+		       __func__, subminor);
 		retval = -ENODEV;
 		goto exit;
 	}
@@ -138,12 +609,17 @@ static int skel_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if (!sf) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+	sf->dev = dev;
+
 	/* increment our usage count for the device */
 	// 取出k-reference?
 	kref_get(&dev->kref);
 
-	printk(KERN_ERR "refcount=%d\n", dev->kref.refcount);
-
 	/* lock the device to allow correctly handling errors
 	 * in resumption */
 	mutex_lock(&dev->io_mutex);
@@ -154,6 +630,7 @@ static int skel_open(struct inode *inode, struct file *file)
 				dev->open_count--;
 				mutex_unlock(&dev->io_mutex);
 				kref_put(&dev->kref, skel_delete);
+				kfree(sf);
 				goto exit;
 			}
 	} /* else { //uncomment this block if you want exclusive open
@@ -166,10 +643,18 @@ static int skel_open(struct inode *inode, struct file *file)
 	/* prevent the device from being autosuspended */
 
 	/* save our object in the file's private structure */
-	file->private_data = dev;
+	file->private_data = sf;
 	mutex_unlock(&dev->io_mutex);
 
+#ifdef FMODE_CAN_ODIRECT
+	/* O_DIRECT reads go straight into the caller's pages */
+	file->f_mode |= FMODE_CAN_ODIRECT;
+#endif
+	/* IOCB_NOWAIT is honoured, io_uring needn't punt to a worker */
+	file->f_mode |= FMODE_NOWAIT;
+
 exit:
+	trace_skel_open(subminor, retval);
 	return retval;
 }
 
@@ -177,402 +662,3971 @@ static int skel_release(struct inode *inode, struct file *file)
 {
 	struct usb_skel *dev;
 
-	dev = file->private_data;
+	dev = skel_file_dev(file);
 	if (dev == NULL)
 		return -ENODEV;
 
 	/* allow the device to be autosuspended */
 	mutex_lock(&dev->io_mutex);
-	if (!--dev->open_count && dev->interface)
+	if (!--dev->open_count && dev->interface) {
+		/* the ring is shared by all openers, the last one stops it */
+		if (dev->read_slots)
+			skel_read_stop(dev);
 		usb_autopm_put_interface(dev->interface);
+	}
 	mutex_unlock(&dev->io_mutex);
 
 	/* decrement the count on our device */
 	kref_put(&dev->kref, skel_delete);
+	kfree(file->private_data);
 	return 0;
 }
 
 static int skel_flush(struct file *file, fl_owner_t id)
 {
 	struct usb_skel *dev;
-	int res;
+	int res, dropped;
 
-	dev = file->private_data;
+	dev = skel_file_dev(file);
 	if (dev == NULL)
 		return -ENODEV;
 
+	/* collected and queued writes go out before we wait for them */
+	skel_write_flush_pending(dev);
+	if (dev->behind_max &&
+	    wait_event_interruptible(dev->bulk_out_wait,
+				     !atomic_read(&dev->behind_nr)))
+		return -ERESTARTSYS;
+
 	/* wait for io to stop */
 	mutex_lock(&dev->io_mutex);
-	skel_draw_down(dev);
+	dropped = skel_draw_down(dev);
 
 	/* read out errors, leave subsequent opens a clean slate */
 	spin_lock_irq(&dev->err_lock);
 	res = dev->errors ? (dev->errors == -EPIPE ? -EPIPE : -EIO) : 0;
 	dev->errors = 0;
 	spin_unlock_irq(&dev->err_lock);
+	if (!res)
+		res = dropped;
 
 	mutex_unlock(&dev->io_mutex);
 
 	return res;
 }
 
+/*
+ * With the ring mapped the application releases slots by moving tail,
+ * pick that up before requeueing.  Called with read_lock held.
+ */
+static void skel_ring_sync_tail(struct usb_skel *dev)
+{
+	unsigned int tail;
+
+	if (!dev->read_mapped)
+		return;
+
+	tail = READ_ONCE(dev->ring_ctrl->tail);
+	/* never release what the device has not filled yet */
+	if (tail - dev->read_consumed <= dev->read_done - dev->read_consumed)
+		dev->read_consumed = tail;
+}
+
 static void skel_read_bulk_callback(struct urb *urb)
 {
+	struct skel_read_slot *slot;
 	struct usb_skel *dev;
+	int status = urb->status;
+	unsigned int i;
+
+	slot = urb->context;
+	dev = slot->dev;
+
+	spin_lock(&dev->read_lock);
+	/* cut after whole packets, the transfer goes on in the next slot */
+	slot->cut = slot->kicked && status == -ECONNRESET &&
+		    urb->actual_length &&
+		    !(urb->actual_length % dev->bulk_in_maxp);
+	if (slot->kicked) {
+		/* our own unlink, whatever arrived is good */
+		if (status == -ECONNRESET)
+			status = 0;
+		/* nothing had: the device is idle, stop batching for now */
+		if (!urb->actual_length)
+			dev->read_irq_always = true;
+		slot->kicked = false;
+	} else if (urb->actual_length) {
+		dev->read_irq_always = false;
+	}
 
-	dev = urb->context;
-
-	spin_lock(&dev->err_lock);
 	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
-			err("%s - nonzero write bulk status received: %d",
-			    __func__, urb->status);
+	if (status) {
+		if (!(status == -ENOENT ||
+		    status == -ECONNRESET ||
+		    status == -ESHUTDOWN)) {
+			dev_err(&dev->udev->dev,
+				"%s - nonzero read bulk status received: %d\n",
+				__func__, status);
+			trace_skel_urb_error(dev->minor, urb, status);
+		}
 
-		dev->errors = urb->status;
+		slot->status = status;
+		slot->filled = 0;
 	} else {
-		dev->bulk_in_filled = urb->actual_length;
+		slot->status = 0;
+		slot->filled = urb->actual_length;
+	}
+	slot->copied = 0;
+	/* urbs on one endpoint complete in the order they were queued */
+	trace_skel_urb_complete(dev->minor, urb,
+				dev->read_posted - dev->read_done);
+	skel_stat_urb(dev, urb, slot->submitted);
+	slot->completed = ktime_get();
+	dev->read_done++;
+
+	if (dev->ring_ctrl) {
+		i = slot - dev->read_slots;
+		dev->ring_ctrl->slot[i].len = slot->filled;
+		dev->ring_ctrl->slot[i].status = slot->status;
+		/* the slot must be visible before the head moves past it */
+		smp_store_release(&dev->ring_ctrl->head, dev->read_done);
+	}
+
+	/* requeue the slots readers have already drained */
+	if (!status)
+		skel_read_refill(dev);
+	spin_unlock(&dev->read_lock);
+
+	wake_up_interruptible_poll(&dev->bulk_in_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* how long a batch may go without a completion before it is kicked */
+static ktime_t skel_read_kick_period(void)
+{
+	return ns_to_ktime((u64)READ_ONCE(irq_batch_usecs) * NSEC_PER_USEC);
+}
+
+/*
+ * Hand every drained slot back to the host controller, in ring order.
+ * Called with read_lock held, from process and completion context alike.
+ */
+static int skel_read_refill(struct usb_skel *dev)
+{
+	unsigned int batch = READ_ONCE(irq_batch);
+	struct skel_read_slot *slot;
+	bool quiet = false;
+	int rv = 0;
+
+	skel_ring_sync_tail(dev);
+	while (dev->read_running &&
+	       dev->read_posted - dev->read_consumed < dev->read_nr) {
+		slot = &dev->read_slots[dev->read_posted % dev->read_nr];
+
+		/* only every batch-th slot interrupts, the others ride along */
+		slot->kicked = false;
+		if (batch > 1 && !dev->read_irq_always &&
+		    (dev->read_posted + 1) % batch) {
+			slot->urb->transfer_flags |= URB_NO_INTERRUPT;
+			quiet = true;
+		} else {
+			slot->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+		}
+
+		usb_anchor_urb(slot->urb, &dev->read_submitted);
+		slot->submitted = ktime_get();
+		rv = usb_submit_urb(slot->urb, GFP_ATOMIC);
+		if (rv < 0) {
+			usb_unanchor_urb(slot->urb);
+			if (rv != -EPERM) {
+				dev_err(&dev->udev->dev,
+					"%s - failed submitting read urb, error %d\n",
+					__func__, rv);
+				trace_skel_urb_error(dev->minor, slot->urb, rv);
+				this_cpu_inc(dev->stats->errors[SKEL_ERR_SUBMIT]);
+			}
+			break;
+		}
+		dev->read_posted++;
+		trace_skel_urb_submit(dev->minor, slot->urb,
+				      dev->read_posted - dev->read_done);
+	}
+
+	/* if the device stops mid-batch nobody would tell us */
+	if (quiet) {
+		dev->read_kick_seq = dev->read_done;
+		hrtimer_start(&dev->read_kick, skel_read_kick_period(),
+			      HRTIMER_MODE_REL_SOFT);
+	}
+
+	return rv;
+}
+
+/*
+ * No interrupt came for a while.  If the oldest outstanding slot is one
+ * that doesn't interrupt it may have completed unnoticed, and unlinking
+ * it makes the host controller give it back along with whatever it
+ * holds.  Had it received nothing the device is idle, and the slots
+ * queued from then on interrupt until data flows again.  While
+ * completions keep coming the batch isn't stalled, look again later.
+ */
+static enum hrtimer_restart skel_read_kick(struct hrtimer *timer)
+{
+	struct usb_skel *dev = container_of(timer, struct usb_skel, read_kick);
+	struct skel_read_slot *slot;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct urb *urb = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->read_lock, flags);
+	if (dev->read_running && dev->read_posted != dev->read_done) {
+		slot = &dev->read_slots[dev->read_done % dev->read_nr];
+		if (dev->read_done != dev->read_kick_seq) {
+			dev->read_kick_seq = dev->read_done;
+			hrtimer_forward_now(timer, skel_read_kick_period());
+			ret = HRTIMER_RESTART;
+		} else if ((slot->urb->transfer_flags & URB_NO_INTERRUPT) &&
+			   !slot->kicked) {
+			slot->kicked = true;
+			urb = usb_get_urb(slot->urb);
+		}
+	}
+	spin_unlock_irqrestore(&dev->read_lock, flags);
+
+	if (urb) {
+		this_cpu_inc(dev->stats->read_kicks);
+		usb_unlink_urb(urb);
+		usb_put_urb(urb);
+	}
+
+	return ret;
+}
+
+static bool skel_read_ready(struct usb_skel *dev)
+{
+	bool ready;
+
+	spin_lock_irq(&dev->read_lock);
+	skel_ring_sync_tail(dev);
+	ready = dev->read_done != dev->read_consumed || !dev->read_running;
+	spin_unlock_irq(&dev->read_lock);
+
+	return ready;
+}
+
+/*
+ * Stop requeueing and take the ring off the bus.  Readers waiting for
+ * it wake up with an error and drop read_mutex.
+ */
+static void skel_read_halt(struct usb_skel *dev)
+{
+	spin_lock_irq(&dev->read_lock);
+	dev->read_running = false;
+	spin_unlock_irq(&dev->read_lock);
+
+	hrtimer_cancel(&dev->read_kick);
+	usb_kill_anchored_urbs(&dev->read_submitted);
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/*
+ * Throw away whatever the halted ring holds.  Called with read_mutex
+ * held, a reader between skel_read_slot_done() and
+ * skel_read_slot_release() would otherwise count a slot of the old
+ * ring against the new one.  A mapped ring is left alone: the
+ * application owns [tail, head) and its counters run on.
+ */
+static void skel_read_reset(struct usb_skel *dev)
+{
+	lockdep_assert_held(&dev->read_mutex);
+
+	spin_lock_irq(&dev->read_lock);
+	if (dev->read_mapped) {
+		spin_unlock_irq(&dev->read_lock);
+		return;
+	}
+	dev->read_syscall = false;
+	dev->read_posted = 0;
+	dev->read_done = 0;
+	dev->read_consumed = 0;
+	if (dev->ring_ctrl) {
+		dev->ring_ctrl->head = 0;
+		dev->ring_ctrl->tail = 0;
+	}
+	spin_unlock_irq(&dev->read_lock);
+}
+
+/* halt and empty the ring, called without read_mutex */
+static void skel_read_stop(struct usb_skel *dev)
+{
+	skel_read_halt(dev);
+	mutex_lock(&dev->read_mutex);
+	skel_read_reset(dev);
+	mutex_unlock(&dev->read_mutex);
+}
+
+/*
+ * Start the ring and wait until a slot has completed, called with
+ * read_mutex held by readers that consume the ring through syscalls.
+ */
+static int skel_read_wait(struct usb_skel *dev, bool nonblock)
+{
+	bool ready, pending;
+	int rv;
+
+	/* the first reader starts the ring, it stays queued until the last close */
+	spin_lock_irq(&dev->read_lock);
+	if (!dev->interface) {		/* disconnect() was called */
+		spin_unlock_irq(&dev->read_lock);
+		return -ENODEV;
+	}
+	if (dev->read_mapped) {
+		/* the application consumes the ring in place */
+		spin_unlock_irq(&dev->read_lock);
+		return -EBUSY;
+	}
+	dev->read_running = true;
+	dev->read_syscall = true;
+	spin_unlock_irq(&dev->read_lock);
+
+	for (;;) {
+		spin_lock_irq(&dev->read_lock);
+		rv = skel_read_refill(dev);
+		ready = dev->read_done != dev->read_consumed;
+		pending = dev->read_posted != dev->read_consumed;
+		spin_unlock_irq(&dev->read_lock);
+
+		if (ready)
+			return 0;
+
+		/* nothing queued and we could not queue anything */
+		if (!pending)
+			return (rv == -ENOMEM) ? rv : -EIO;
+
+		/* nonblocking IO shall not wait */
+		if (nonblock)
+			return -EAGAIN;
+
+		/*
+		 * IO may take forever
+		 * hence wait in an interruptible state
+		 */
+		rv = wait_event_interruptible(dev->bulk_in_wait,
+					      skel_read_ready(dev));
+		if (rv < 0)
+			return rv;
+		/* the ring was torn down under us */
+		if (!dev->read_running)
+			return -EIO;
+	}
+}
+
+/* the oldest completed slot, or NULL if the host controller owns it */
+static struct skel_read_slot *skel_read_slot_done(struct usb_skel *dev)
+{
+	struct skel_read_slot *slot = NULL;
+
+	spin_lock_irq(&dev->read_lock);
+	if (dev->read_done != dev->read_consumed)
+		slot = &dev->read_slots[dev->read_consumed % dev->read_nr];
+	/* the first look at a slot is when the reader got to it */
+	if (slot && slot->completed) {
+		this_cpu_inc(dev->stats->wake_lat[skel_lat_bucket(slot->completed)]);
+		slot->completed = 0;
+	}
+	spin_unlock_irq(&dev->read_lock);
+
+	return slot;
+}
+
+/* the oldest completed slot has been drained, queue it again */
+static void skel_read_slot_release(struct usb_skel *dev)
+{
+	spin_lock_irq(&dev->read_lock);
+	dev->read_consumed++;
+	skel_read_refill(dev);
+	spin_unlock_irq(&dev->read_lock);
+}
+
+/* copy part of a completed slot out, walking the pages of an sg buffer */
+static int skel_copy_slot_to_iter(struct iov_iter *to, struct skel_read_slot *slot,
+				  size_t offset, size_t len)
+{
+	struct page *page;
+	size_t chunk;
+
+	if (slot->buffer)
+		return copy_to_iter(slot->buffer + offset, len, to) == len ?
+		       0 : -EFAULT;
+
+	while (len) {
+		page = skel_slot_page(slot->dev, slot, offset >> PAGE_SHIFT);
+		chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(offset));
+		if (copy_page_to_iter(page, offset_in_page(offset), chunk,
+				      to) != chunk)
+			return -EFAULT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/* an error out of a urb as the caller should see it */
+static int skel_urb_error(int status)
+{
+	/* to preserve notifications about reset */
+	return (status == -EPIPE) ? status : -EIO;
+}
+
+/* readv()/writev() with several segments, one message in pieces */
+static bool skel_iter_vectored(const struct iov_iter *iter)
+{
+	return iter_is_iovec(iter) && iter->nr_segs > 1;
+}
+
+/*
+ * Asynchronous transfers get their own budget instead of write slots,
+ * a submitter may keep aio_depth of them outstanding per device.
+ */
+static int skel_aio_get(struct usb_skel *dev, struct kiocb *iocb)
+{
+	unsigned int depth = max(aio_depth, 1U);
+
+	if (atomic_add_unless(&dev->aio_in_flight, 1, depth))
+		return 0;
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	return wait_event_interruptible(dev->aio_wait,
+			atomic_add_unless(&dev->aio_in_flight, 1, depth));
+}
+
+static void skel_aio_put(struct usb_skel *dev)
+{
+	atomic_dec(&dev->aio_in_flight);
+	wake_up(&dev->aio_wait);
+}
+
+/*
+ * A write sent at submitted completed, feed it to the window.  One sent
+ * without a completion interrupt is seen only along with the urb that
+ * raised the next one, and counts with that urb's latency.  A round lasts
+ * until a window's worth of writes completed.  By Little's law the
+ * writes queued beyond what the latency floor needs at the rate of the
+ * round are urbs * (average latency - floor) / duration.  Few of them
+ * while writers were waiting for slots means the link has room, grow
+ * by one; many of them means they only add latency, shrink by one.
+ */
+static void skel_window_sample(struct usb_skel *dev, ktime_t submitted,
+			       bool quiet)
+{
+	struct skel_write_window *w = &dev->wwin;
+	ktime_t now = ktime_get();
+	u64 lat_ns = ktime_to_ns(ktime_sub(now, submitted));
+	unsigned long flags;
+	u64 elapsed, avg, queued;
+	bool grew = false;
+
+	spin_lock_irqsave(&w->lock, flags);
+	if (quiet) {
+		w->batched++;
+		goto out;
+	}
+	w->urbs += w->batched + 1;
+	w->lat_sum += lat_ns * (w->batched + 1);
+	w->batched = 0;
+	if (!w->round_min || lat_ns < w->round_min)
+		w->round_min = lat_ns;
+	if (!w->lat_min || lat_ns < w->lat_min)
+		w->lat_min = lat_ns;
+	if (w->urbs < w->size)
+		goto out;
+
+	elapsed = ktime_to_ns(ktime_sub(now, w->start));
+	avg = div_u64(w->lat_sum, w->urbs);
+	queued = elapsed ? div64_u64(w->urbs * (avg - w->lat_min), elapsed) : 0;
+
+	if (queued > WRITE_WINDOW_QUEUE && w->size > w->min) {
+		w->size--;
+	} else if (!queued && w->limited && w->size < w->max) {
+		w->size++;
+		grew = true;
+	}
+
+	/* the floor moves with the device, measure it again now and then */
+	if (++w->rounds >= WRITE_WINDOW_ROUNDS) {
+		w->rounds = 0;
+		w->lat_min = w->round_min;
+	}
+	w->start = now;
+	w->urbs = 0;
+	w->lat_sum = 0;
+	w->round_min = 0;
+	w->limited = false;
+out:
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	if (grew)
+		wake_up_interruptible_poll(&dev->bulk_out_wait,
+					   EPOLLOUT | EPOLLWRNORM);
+}
+
+static struct skel_dio *skel_dio_alloc(struct usb_skel *dev,
+				       struct kiocb *iocb)
+{
+	struct skel_dio *dio;
+
+	dio = kzalloc(sizeof(*dio), GFP_KERNEL);
+	if (!dio)
+		return NULL;
+
+	dio->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!dio->urb) {
+		kfree(dio);
+		return NULL;
+	}
+	dio->dev = dev;
+	dio->iocb = is_sync_kiocb(iocb) ? NULL : iocb;
+	init_completion(&dio->done);
+
+	return dio;
+}
+
+/* may sleep, unpinning dirties the pages */
+static void skel_dio_free(struct skel_dio *dio)
+{
+	if (dio->unpin) {
+		if (dio->dirty)
+			unpin_user_pages_dirty_lock(dio->pages, dio->nr_pages,
+						    true);
+		else
+			unpin_user_pages(dio->pages, dio->nr_pages);
+	}
+	if (dio->bounce)
+		usb_free_coherent(dio->dev->udev, dio->len, dio->bounce,
+				  dio->urb->transfer_dma);
+	usb_free_urb(dio->urb);
+	kvfree(dio->sg);
+	kvfree(dio->pages);
+	kfree(dio);
+}
+
+/* asynchronous transfers are freed here, their completion can't sleep */
+static void skel_dio_reap(struct work_struct *work)
+{
+	struct usb_skel *dev = container_of(work, struct usb_skel, dio_work);
+	struct llist_node *list = llist_del_all(&dev->dio_reap);
+	struct skel_dio *dio, *next;
+	unsigned int n = 0;
+
+	llist_for_each_entry_safe(dio, next, list, reap) {
+		skel_dio_free(dio);
+		n++;
+	}
+
+	/* each of them held a reference to the device */
+	while (n--)
+		kref_put(&dev->kref, skel_delete);
+}
+
+/*
+ * Collect the pages behind the next len bytes of an iterator into the
+ * sg list of a transfer.  User memory gets pinned, kernel memory (a
+ * bvec from splice, for instance) is used as it is.
+ */
+static int skel_dio_map_iter(struct skel_dio *dio, struct iov_iter *iter,
+			     size_t len)
+{
+	struct iov_iter piece = *iter;
+	struct page **pages;
+	size_t offset, chunk;
+	unsigned int max;
+	ssize_t got;
+
+	/* room for the pages of these len bytes, not the whole iterator */
+	iov_iter_truncate(&piece, len);
+	max = iov_iter_npages(&piece, INT_MAX);
+
+	dio->pages = kvmalloc_array(max, sizeof(*dio->pages), GFP_KERNEL);
+	dio->sg = kvmalloc_array(max, sizeof(*dio->sg), GFP_KERNEL);
+	if (!dio->pages || !dio->sg)
+		return -ENOMEM;
+	sg_init_table(dio->sg, max);
+	dio->unpin = iov_iter_extract_will_pin(iter);
+
+	while (len) {
+		pages = dio->pages + dio->nr_pages;
+		got = iov_iter_extract_pages(iter, &pages, len,
+					     max - dio->nr_pages, 0, &offset);
+		if (got <= 0)
+			return got ? got : -EFAULT;
+		len -= got;
+
+		while (got) {
+			chunk = min_t(size_t, got, PAGE_SIZE - offset);
+			sg_set_page(&dio->sg[dio->nr_pages],
+				    dio->pages[dio->nr_pages], chunk, offset);
+			dio->nr_pages++;
+			got -= chunk;
+			offset = 0;
+		}
+	}
+	sg_mark_end(&dio->sg[dio->nr_pages - 1]);
+
+	dio->urb->sg = dio->sg;
+	dio->urb->num_sgs = dio->nr_pages;
+	return 0;
+}
+
+/* transfers outstanding alongside this one, for the trace events */
+static unsigned int skel_dio_depth(struct skel_dio *dio)
+{
+	if (dio->iocb)
+		return atomic_read(&dio->dev->aio_in_flight);
+	/* synchronous direct writes hold a write slot, reads run alone */
+	if (usb_urb_dir_out(dio->urb))
+		return atomic_read(&dio->dev->writes_in_flight);
+	return 1;
+}
+
+/* what a finished transfer tells its caller */
+static long skel_dio_result(struct skel_dio *dio)
+{
+	struct urb *urb = dio->urb;
+
+	/* whatever arrived before an unlink is the caller's already */
+	if (urb->actual_length)
+		return urb->actual_length;
+	if (urb->status)
+		return skel_urb_error(urb->status);
+	return 0;
+}
+
+static void skel_dio_callback(struct urb *urb)
+{
+	struct skel_dio *dio = urb->context;
+	struct usb_skel *dev = dio->dev;
+
+	trace_skel_urb_complete(dev->minor, urb, skel_dio_depth(dio));
+	skel_stat_urb(dev, urb, dio->submitted);
+
+	/* sync/async unlink faults aren't errors */
+	if (urb->status &&
+	    !(urb->status == -ENOENT ||
+	      urb->status == -ECONNRESET ||
+	      urb->status == -ESHUTDOWN)) {
+		dev_err(&dev->udev->dev,
+			"%s - nonzero bulk status received: %d\n",
+			__func__, urb->status);
+		trace_skel_urb_error(dev->minor, urb, urb->status);
 	}
-	dev->ongoing_read = 0;
-	spin_unlock(&dev->err_lock);
 
-	complete(&dev->bulk_in_completion);
+	/* the slot put or the waiter that follows wakes skel_write_sync() */
+	if (usb_urb_dir_out(urb))
+		atomic_inc(&dev->write_done);
+
+	if (!dio->iocb) {
+		/* synchronous writes hold a write slot */
+		if (usb_urb_dir_out(urb) && !urb->status)
+			skel_window_sample(dev, dio->submitted, false);
+		dio->completed = ktime_get();
+		complete(&dio->done);
+		return;
+	}
+
+	/* zero length transfers carry nothing, like in the ring */
+	if (usb_urb_dir_in(urb) && !urb->status && !urb->actual_length) {
+		usb_anchor_urb(urb, &dev->read_submitted);
+		dio->submitted = ktime_get();
+		if (!usb_submit_urb(urb, GFP_ATOMIC)) {
+			trace_skel_urb_submit(dev->minor, urb,
+					      skel_dio_depth(dio));
+			return;
+		}
+		usb_unanchor_urb(urb);
+		urb->status = -EIO;
+	}
+
+	dio->iocb->ki_complete(dio->iocb, skel_dio_result(dio));
+	/* asynchronous writes hold a write slot too */
+	if (usb_urb_dir_out(urb)) {
+		if (!urb->status)
+			skel_window_sample(dev, dio->submitted, false);
+		skel_write_slot_put(dev);
+	}
+	skel_aio_put(dev);
+
+	if (llist_add(&dio->reap, &dev->dio_reap))
+		schedule_work(&dev->dio_work);
+}
+
+/*
+ * Send a transfer that is ready to go.  An asynchronous one belongs to
+ * the completion handler from here on.
+ */
+static int skel_dio_start(struct skel_dio *dio, struct usb_anchor *anchor)
+{
+	struct usb_skel *dev = dio->dev;
+	int rv;
+
+	reinit_completion(&dio->done);
+
+	if (dio->iocb)
+		kref_get(&dev->kref);
+	usb_anchor_urb(dio->urb, anchor);
+	dio->submitted = ktime_get();
+	rv = usb_submit_urb(dio->urb, GFP_KERNEL);
+	if (rv < 0) {
+		usb_unanchor_urb(dio->urb);
+		if (dio->iocb)
+			kref_put(&dev->kref, skel_delete);
+		dev_err(&dev->udev->dev,
+			"%s - failed submitting urb, error %d\n", __func__, rv);
+		trace_skel_urb_error(dev->minor, dio->urb, rv);
+		this_cpu_inc(dev->stats->errors[SKEL_ERR_SUBMIT]);
+		return (rv == -ENOMEM) ? rv : -EIO;
+	}
+	if (usb_urb_dir_out(dio->urb))
+		WRITE_ONCE(dev->write_sent, dev->write_sent + 1);
+	trace_skel_urb_submit(dev->minor, dio->urb, skel_dio_depth(dio));
+
+	return 0;
+}
+
+/* wait for a synchronous transfer to finish */
+static long skel_dio_wait(struct skel_dio *dio, struct usb_anchor *anchor)
+{
+	struct urb *urb = dio->urb;
+	long rv;
+
+	for (;;) {
+		/* IO may take forever, hence wait in an interruptible state */
+		rv = wait_for_completion_interruptible(&dio->done);
+		if (rv < 0) {
+			usb_kill_urb(urb);
+			wait_for_completion(&dio->done);
+			break;
+		}
+		this_cpu_inc(dio->dev->stats->wake_lat[skel_lat_bucket(dio->completed)]);
+
+		/* zero length transfers carry nothing, like in the ring */
+		if (!usb_urb_dir_in(urb) || urb->status || urb->actual_length)
+			break;
+		rv = skel_dio_start(dio, anchor);
+		if (rv < 0)
+			return rv;
+	}
+
+	if (rv < 0 && !urb->actual_length)
+		return rv;
+	return skel_dio_result(dio);
+}
+
+/*
+ * Direct reads bypass the ring.  They need an HCD that takes the sg
+ * list and, unless it takes any sg list, whole packets in every entry
+ * but the last, like direct writes.  The ring must be idle, otherwise
+ * data queued in it would be overtaken: once read() or poll() started
+ * it, reads go through it until the last close.
+ */
+static bool skel_read_direct_ok(struct usb_skel *dev, struct iov_iter *to)
+{
+	struct usb_bus *bus = dev->udev->bus;
+	size_t maxp = dev->bulk_in_maxp;
+	size_t count = iov_iter_count(to);
+	bool idle;
+
+	if (count > READ_SIZE_MAX)
+		return false;
+	if (iov_iter_npages(to, INT_MAX) > bus->sg_tablesize)
+		return false;
+	if (!bus->no_sg_constraint &&
+	    (!is_power_of_2(maxp) || maxp > PAGE_SIZE ||
+	     (iov_iter_alignment(to) & (maxp - 1))))
+		return false;
+
+	spin_lock_irq(&dev->read_lock);
+	idle = !dev->read_running;
+	spin_unlock_irq(&dev->read_lock);
+
+	return idle;
+}
+
+/*
+ * Let the device DMA straight into the caller's pages.  An asynchronous
+ * caller got its aio_depth share before and hands it over to us.
+ */
+static ssize_t skel_read_direct(struct usb_skel *dev, struct kiocb *iocb,
+				struct iov_iter *to)
+{
+	size_t count = iov_iter_count(to);
+	struct skel_dio *dio;
+	ssize_t rv;
+
+	rv = -ENOMEM;
+	dio = skel_dio_alloc(dev, iocb);
+	if (!dio)
+		goto out;
+
+	rv = skel_dio_map_iter(dio, to, count);
+	if (rv < 0)
+		goto out;
+	dio->dirty = true;
+
+	usb_fill_bulk_urb(dio->urb, dev->udev,
+			  usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+			  NULL, count, skel_dio_callback, dio);
+
+	/* read_stop() kills it along with the ring */
+	rv = skel_dio_start(dio, &dev->read_submitted);
+	if (!rv && dio->iocb)
+		return -EIOCBQUEUED;
+	if (!rv)
+		rv = skel_dio_wait(dio, &dev->read_submitted);
+
+out:
+	if (dio)
+		skel_dio_free(dio);
+	if (!is_sync_kiocb(iocb))
+		skel_aio_put(dev);
+	return rv;
+}
+
+/*
+ * Hand out the next completed transfer as one message, what doesn't
+ * fit is dropped.  Returns 0 if there were only empty ones.  Called
+ * with read_mutex held.
+ */
+static ssize_t skel_read_msg(struct skel_file *sf, struct iov_iter *to)
+{
+	struct usb_skel *dev = sf->dev;
+	struct skel_read_slot *slot;
+	size_t len, chunk;
+	int rv;
+
+	while ((slot = skel_read_slot_done(dev))) {
+		if (slot->status) {
+			/* any error is reported once */
+			rv = skel_urb_error(slot->status);
+			skel_read_slot_release(dev);
+			return rv;
+		}
+
+		len = slot->filled - slot->copied;
+		if (!len) {
+			skel_read_slot_release(dev);
+			continue;
+		}
+
+		chunk = min(len, iov_iter_count(to));
+		rv = skel_copy_slot_to_iter(to, slot, slot->copied, chunk);
+		if (rv < 0)
+			return rv;
+
+		sf->msg.len = len;
+		sf->msg.flags = 0;
+		if (chunk < len)
+			sf->msg.flags |= SKEL_MSG_TRUNC;
+		if (slot->filled == dev->bulk_in_size || slot->cut)
+			sf->msg.flags |= SKEL_MSG_MORE;
+		skel_read_slot_release(dev);
+		return chunk;
+	}
+
+	return 0;
+}
+
+static ssize_t skel_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct usb_skel *dev;
+	struct skel_read_slot *slot;
+	size_t count = iov_iter_count(to);
+	size_t copied = 0;
+	bool nonblock, aio = false;
+	int rv;
+
+	//取出從open那邊 attach 上來的 usb_skel
+	dev = skel_file_dev(file);
+	/*
+	 * an asynchronous read that can't go direct is served from the
+	 * ring in the submitter, it takes what is there or gets -EAGAIN
+	 * rather than hold up the submission
+	 */
+	nonblock = (file->f_flags & O_NONBLOCK) ||
+		   (iocb->ki_flags & IOCB_NOWAIT) || !is_sync_kiocb(iocb);
+
+	//檢查 ring 與 count 是否有配置，ring 就是在probe那邊配置的一組 urb
+	/* if we cannot read at all, return EOF */
+
+	if (!dev->read_slots || !count)
+		return 0;
+
+	/*
+	 * an asynchronous read waits for its aio_depth share before it
+	 * takes read_mutex, so it doesn't hold up the other readers
+	 */
+	if (!is_sync_kiocb(iocb) && !skel_msg_mode(file)) {
+		rv = skel_aio_get(dev, iocb);
+		if (rv < 0)
+			return skel_stat_ret(dev, rv);
+		aio = true;
+	}
+
+	/* no concurrent readers, writers go on regardless */
+	if ((iocb->ki_flags & IOCB_NOWAIT) || !is_sync_kiocb(iocb)) {
+		if (!mutex_trylock(&dev->read_mutex)) {
+			rv = -EAGAIN;
+			goto put;
+		}
+	} else {
+		rv = mutex_lock_interruptible(&dev->read_mutex);
+		if (rv < 0)
+			goto put;
+	}
+
+	//檢查interface是否有值
+	if (!dev->interface) {		/* disconnect() was called */
+		rv = -ENODEV;
+		goto exit;
+	}
+
+	/*
+	 * asynchronous reads can only complete into pinned pages,
+	 * synchronous ones go there when asked to with O_DIRECT, and
+	 * readv() lets one transfer scatter straight into its segments.
+	 * Messages always come out of the ring.
+	 */
+	if (!skel_msg_mode(file) &&
+	    (!is_sync_kiocb(iocb) || skel_iter_vectored(to) ||
+	     ((iocb->ki_flags & IOCB_DIRECT) && count >= direct_read_min)) &&
+	    skel_read_direct_ok(dev, to)) {
+		aio = false;
+		rv = skel_read_direct(dev, iocb, to);
+		goto exit;
+	}
+
+	//這邊作一個goto tag, 目的就是要retry
+retry:
+	rv = skel_read_wait(dev, nonblock);
+	if (rv < 0)
+		goto exit;
+
+	if (skel_msg_mode(file)) {
+		rv = skel_read_msg(file->private_data, to);
+		/* only zero length transfers were drained, keep waiting */
+		if (!rv)
+			goto retry;
+		goto exit;
+	}
+
+	/*
+	 * drain completed slots in order until the request is satisfied
+	 * or we run into a slot the host controller still owns
+	 */
+	while (copied < count) {
+		size_t available, chunk;
+
+		slot = skel_read_slot_done(dev);
+		if (!slot)
+			break;
+
+		/* errors must be reported */
+		if (slot->status) {
+			/* hand out the data we already have first */
+			if (copied)
+				break;
+			/* any error is reported once */
+			rv = skel_urb_error(slot->status);
+			skel_read_slot_release(dev);
+			/* report it */
+			goto exit;
+		}
+
+		available = slot->filled - slot->copied;
+		chunk = min(available, count - copied);
+
+		/*
+		 * data is available
+		 * chunk tells us how much shall be copied
+		 */
+		if (chunk) {
+			rv = skel_copy_slot_to_iter(to, slot, slot->copied,
+						    chunk);
+			if (rv < 0)
+				goto exit;
+		}
+		slot->copied += chunk;
+		copied += chunk;
+
+		/* all data has been used, give the slot back */
+		if (slot->copied == slot->filled)
+			skel_read_slot_release(dev);
+	}
+
+	/* only zero length transfers were drained, keep waiting */
+	if (!copied)
+		goto retry;
+	rv = copied;
+exit:
+	mutex_unlock(&dev->read_mutex);
+put:
+	/* unless skel_read_direct() took it over */
+	if (aio)
+		skel_aio_put(dev);
+	trace_skel_read(dev->minor, count, iocb->ki_flags, rv);
+	return skel_stat_ret(dev, rv);
+}
+
+static const struct pipe_buf_operations skel_pipe_buf_ops = {
+	.release =	generic_pipe_buf_release,
+	.try_steal =	generic_pipe_buf_try_steal,
+	.get =		generic_pipe_buf_get,
+};
+
+/*
+ * Move the next piece of a completed slot into the pipe, at most up to
+ * the end of its page.  If nothing else in the page is waiting the page
+ * itself goes to the pipe and a fresh one takes its place in the sg
+ * list for the next transfer.  Partial pages and contiguous buffers
+ * can't be given away and are copied.  The caller made sure the pipe
+ * has room.
+ */
+static ssize_t skel_splice_slot_page(struct usb_skel *dev,
+				     struct skel_read_slot *slot,
+				     struct pipe_inode_info *pipe, size_t len)
+{
+	struct pipe_buffer buf = { .ops = &skel_pipe_buf_ops };
+	unsigned int i = slot->copied >> PAGE_SHIFT;
+	size_t offset = offset_in_page(slot->copied);
+	size_t page_end, chunk;
+	struct page *fresh;
+	bool steal;
+	ssize_t rv;
+
+	page_end = min_t(size_t, slot->filled, (size_t)(i + 1) << PAGE_SHIFT);
+	chunk = min(len, page_end - slot->copied);
+
+	fresh = alloc_page(GFP_KERNEL);
+	if (!fresh)
+		return -ENOMEM;
+
+	steal = slot->sg && slot->copied + chunk == page_end;
+	if (steal) {
+		/* the pipe's reference, add_to_pipe() drops it on failure */
+		buf.page = sg_page(&slot->sg[i]);
+		get_page(buf.page);
+		buf.offset = offset;
+	} else {
+		memcpy(page_address(fresh),
+		       page_address(skel_slot_page(dev, slot, i)) + offset,
+		       chunk);
+		buf.page = fresh;
+		buf.offset = 0;
+	}
+	buf.len = chunk;
+
+	rv = add_to_pipe(pipe, &buf);
+	if (!steal)
+		return rv;
+	if (rv < 0) {
+		/* the data stays in the slot for the next try */
+		__free_page(fresh);
+		return rv;
+	}
+	/* only now the page is the pipe's alone */
+	put_page(buf.page);
+	sg_set_page(&slot->sg[i], fresh, slot->sg[i].length, 0);
+	return rv;
+}
+
+/* hand completed bulk-in transfers to a pipe without a trip to user space */
+static ssize_t skel_splice_read(struct file *file, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+	struct usb_skel *dev;
+	struct skel_read_slot *slot;
+	size_t spliced = 0;
+	bool nonblock;
+	ssize_t rv;
+
+	dev = skel_file_dev(file);
+	nonblock = (file->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+
+	if (!dev->read_slots || !len)
+		return 0;
+
+	/* no concurrent readers */
+	rv = mutex_lock_interruptible(&dev->read_mutex);
+	if (rv < 0)
+		return rv;
+
+	if (!dev->interface) {		/* disconnect() was called */
+		rv = -ENODEV;
+		goto exit;
+	}
+
+retry:
+	rv = skel_read_wait(dev, nonblock);
+	if (rv < 0)
+		goto exit;
+
+	while (spliced < len) {
+		if (!pipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			rv = -EPIPE;
+			break;
+		}
+		if (pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+			rv = -EAGAIN;
+			break;
+		}
+
+		slot = skel_read_slot_done(dev);
+		if (!slot)
+			break;
+
+		/* errors must be reported, after the data we already have */
+		if (slot->status) {
+			if (!spliced) {
+				rv = skel_urb_error(slot->status);
+				skel_read_slot_release(dev);
+			}
+			break;
+		}
+
+		if (slot->copied < slot->filled) {
+			rv = skel_splice_slot_page(dev, slot, pipe,
+						   len - spliced);
+			if (rv < 0)
+				break;
+			slot->copied += rv;
+			spliced += rv;
+			rv = 0;
+		}
+
+		/* all data has been used, give the slot back */
+		if (slot->copied == slot->filled)
+			skel_read_slot_release(dev);
+	}
+
+	if (spliced)
+		rv = spliced;
+	else if (!rv)
+		/* only zero length transfers were drained, keep waiting */
+		goto retry;
+exit:
+	mutex_unlock(&dev->read_mutex);
+	return skel_stat_ret(dev, rv);
+}
+
+/* take a write slot if the window has one left */
+static bool skel_write_slot_try(struct usb_skel *dev)
+{
+	int n, peak;
+
+	n = atomic_read(&dev->writes_in_flight);
+	do {
+		if (n >= READ_ONCE(dev->wwin.size)) {
+			/* the window, not the writers, held things up */
+			WRITE_ONCE(dev->wwin.limited, true);
+			return false;
+		}
+	} while (!atomic_try_cmpxchg(&dev->writes_in_flight, &n, n + 1));
+
+	peak = atomic_read(&dev->writes_peak);
+	while (n + 1 > peak &&
+	       !atomic_try_cmpxchg(&dev->writes_peak, &peak, n + 1))
+		;
+
+	return true;
+}
+
+/*
+ * limit the number of URBs in flight to stop a user from using up all
+ * RAM
+ */
+static int skel_write_slot_get(struct usb_skel *dev, struct kiocb *iocb)
+{
+	if (skel_write_slot_try(dev))
+		return 0;
+	if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	    (iocb->ki_flags & IOCB_NOWAIT))
+		return -EAGAIN;
+
+	if (wait_event_interruptible(dev->bulk_out_wait,
+				     skel_write_slot_try(dev)))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+static void skel_write_slot_put(struct usb_skel *dev)
+{
+	unsigned long flags;
+
+	atomic_dec(&dev->writes_in_flight);
+	wake_up_interruptible_poll(&dev->bulk_out_wait, EPOLLOUT | EPOLLWRNORM);
+
+	/* under the lock, skel_write_behind_run() sees the slot or runs again */
+	if (dev->behind_max) {
+		spin_lock_irqsave(&dev->behind_lock, flags);
+		if (!list_empty(&dev->behind))
+			schedule_work(&dev->behind_work);
+		spin_unlock_irqrestore(&dev->behind_lock, flags);
+	}
+}
+
+static void skel_write_buf_put(struct usb_skel *dev, struct skel_write_buf *wb)
+{
+	llist_add(&wb->node, &dev->write_pool);
+}
+
+static void skel_write_bulk_callback(struct urb *urb)
+{
+	struct skel_write_buf *wb;
+	struct usb_skel *dev;
+
+	wb = urb->context;
+	dev = wb->dev;
+	trace_skel_urb_complete(dev->minor, urb,
+				atomic_read(&dev->writes_in_flight));
+	skel_stat_urb(dev, urb, wb->submitted);
+
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN)) {
+			dev_err(&dev->udev->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+			trace_skel_urb_error(dev->minor, urb, urb->status);
+		}
+
+		spin_lock(&dev->err_lock);
+		dev->errors = urb->status;
+		spin_unlock(&dev->err_lock);
+	} else {
+		skel_window_sample(dev, wb->submitted,
+				   urb->transfer_flags & URB_NO_INTERRUPT);
+	}
+
+	/* the buffer is ready for the next write */
+	atomic_inc(&dev->write_done);
+	skel_write_buf_put(dev, wb);
+	skel_write_slot_put(dev);
+}
+
+static struct skel_write_buf *skel_alloc_write_buf(struct usb_skel *dev)
+{
+	struct skel_write_buf *wb;
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return NULL;
+	wb->dev = dev;
+
+	wb->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!wb->urb)
+		goto error;
+
+	wb->buffer = usb_alloc_coherent(dev->udev, dev->bulk_out_size,
+					GFP_KERNEL, &wb->urb->transfer_dma);
+	if (!wb->buffer)
+		goto error;
+
+	usb_fill_bulk_urb(wb->urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			  wb->buffer, dev->bulk_out_size,
+			  skel_write_bulk_callback, wb);
+	wb->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	llist_add(&wb->all, &dev->write_bufs);
+	return wb;
+
+error:
+	skel_free_write_buf(dev, wb);
+	return NULL;
+}
+
+/*
+ * A buffer goes back before its write slot does, so whoever holds a
+ * slot finds one here unless the window has grown past the buffers
+ * allocated so far.  Then one more is made, and kept for good.
+ */
+static struct skel_write_buf *skel_write_buf_get(struct usb_skel *dev)
+{
+	struct llist_node *node;
+
+	/* llist_del_first() must not race with itself, llist_add() may */
+	spin_lock(&dev->write_pool_lock);
+	node = llist_del_first(&dev->write_pool);
+	spin_unlock(&dev->write_pool_lock);
+
+	if (!node)
+		return skel_alloc_write_buf(dev);
+	return llist_entry(node, struct skel_write_buf, node);
+}
+
+/* report an earlier write error once, and clear it */
+static int skel_write_errors(struct usb_skel *dev)
+{
+	int retval;
+
+	spin_lock_irq(&dev->err_lock);
+	retval = dev->errors;
+	if (retval < 0) {
+		/* any error is reported once */
+		dev->errors = 0;
+		retval = skel_urb_error(retval);
+	}
+	spin_unlock_irq(&dev->err_lock);
+
+	return retval;
+}
+
+/*
+ * Pages that already live in the kernel, like the pipe buffers
+ * iter_file_splice_write() hands us, go out as they are if the host
+ * controller takes them as one sg list.  So do the segments of a
+ * writev(), and user buffers of at least direct_write_min, pinned.
+ * This looks at the next WRITE_DIRECT_MAX bytes, as much as one urb
+ * takes.
+ */
+static bool skel_write_direct_ok(struct usb_skel *dev, struct iov_iter *from)
+{
+	struct usb_bus *bus = dev->udev->bus;
+	size_t maxp = dev->bulk_out_maxp;
+	struct iov_iter piece;
+
+	if (!iov_iter_is_bvec(from) && !skel_iter_vectored(from) &&
+	    !(user_backed_iter(from) &&
+	      iov_iter_count(from) >= READ_ONCE(direct_write_min)))
+		return false;
+
+	piece = *from;
+	iov_iter_truncate(&piece, WRITE_DIRECT_MAX);
+	if (iov_iter_npages(&piece, INT_MAX) > bus->sg_tablesize)
+		return false;
+
+	/* every sg entry but the last must be whole packets */
+	if (!bus->no_sg_constraint &&
+	    (!is_power_of_2(maxp) || maxp > PAGE_SIZE ||
+	     (iov_iter_alignment(&piece) & (maxp - 1))))
+		return false;
+
+	return true;
+}
+
+/*
+ * An asynchronous write is copied into its own buffer like any other,
+ * or sent from the caller's pinned pages where a direct write would be,
+ * but the caller hears about it only once the device has taken it.
+ * Besides its aio_depth share it takes a write slot, so the window
+ * governs it like every other write.
+ */
+static ssize_t skel_write_async(struct usb_skel *dev, struct kiocb *iocb,
+				struct iov_iter *from)
+{
+	size_t writesize = min(iov_iter_count(from), dev->bulk_out_size);
+	bool direct = skel_write_direct_ok(dev, from);
+	struct skel_dio *dio;
+	ssize_t retval;
+
+	/* copies queued by write_behind go out ahead of it */
+	if (dev->behind_max && atomic_read(&dev->behind_nr)) {
+		if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		    (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->bulk_out_wait,
+					     !atomic_read(&dev->behind_nr)))
+			return -ERESTARTSYS;
+	}
+
+	retval = skel_aio_get(dev, iocb);
+	if (retval < 0)
+		return retval;
+
+	retval = skel_write_slot_get(dev, iocb);
+	if (retval < 0)
+		goto error;
+
+	retval = skel_write_errors(dev);
+	if (retval < 0)
+		goto error_slot;
+
+	retval = -ENOMEM;
+	dio = skel_dio_alloc(dev, iocb);
+	if (!dio)
+		goto error_slot;
+
+	if (direct) {
+		writesize = min_t(size_t, iov_iter_count(from),
+				  WRITE_DIRECT_MAX);
+		retval = skel_dio_map_iter(dio, from, writesize);
+		if (retval < 0)
+			goto error_free;
+	} else {
+		dio->len = writesize;
+		dio->bounce = usb_alloc_coherent(dev->udev, writesize,
+						 GFP_KERNEL,
+						 &dio->urb->transfer_dma);
+		if (!dio->bounce)
+			goto error_free;
+
+		if (copy_from_iter(dio->bounce, writesize, from) != writesize) {
+			retval = -EFAULT;
+			goto error_free;
+		}
+	}
+
+	usb_fill_bulk_urb(dio->urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			  dio->bounce, writesize, skel_dio_callback, dio);
+	if (!direct)
+		dio->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	if (skel_msg_mode(iocb->ki_filp))
+		dio->urb->transfer_flags |= URB_ZERO_PACKET;
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error_free;
+	}
+	retval = skel_dio_start(dio, &dev->submitted);
+	mutex_unlock(&dev->io_mutex);
+	if (!retval)
+		return -EIOCBQUEUED;
+
+error_free:
+	skel_dio_free(dio);
+error_slot:
+	skel_write_slot_put(dev);
+error:
+	skel_aio_put(dev);
+	return retval;
+}
+
+/*
+ * Send up to WRITE_DIRECT_MAX bytes of the caller's pages and wait
+ * until the device has taken them.  Errors are reported like in
+ * skel_write_chunk().  Bytes the device didn't take are given back to
+ * the iterator.
+ */
+static ssize_t skel_write_direct(struct usb_skel *dev, struct kiocb *iocb,
+				 struct iov_iter *from, bool first)
+{
+	size_t count = min_t(size_t, iov_iter_count(from), WRITE_DIRECT_MAX);
+	struct skel_dio *dio = NULL;
+	bool mapped = false;
+	ssize_t retval;
+
+	/* it takes a write slot like any other write */
+	retval = skel_write_slot_get(dev, iocb);
+	if (retval < 0)
+		return retval;
+
+	if (first)
+		retval = skel_write_errors(dev);
+	else if (READ_ONCE(dev->errors) < 0)
+		retval = -EIO;
+	if (retval < 0)
+		goto out;
+
+	retval = -ENOMEM;
+	dio = skel_dio_alloc(dev, iocb);
+	if (!dio)
+		goto out;
+
+	retval = skel_dio_map_iter(dio, from, count);
+	if (retval < 0)
+		goto out;
+	mapped = true;
+
+	usb_fill_bulk_urb(dio->urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			  NULL, count, skel_dio_callback, dio);
+	if (skel_msg_mode(iocb->ki_filp))
+		dio->urb->transfer_flags |= URB_ZERO_PACKET;
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto out;
+	}
+	retval = skel_dio_start(dio, &dev->submitted);
+	mutex_unlock(&dev->io_mutex);
+	if (!retval)
+		retval = skel_dio_wait(dio, &dev->submitted);
+
+out:
+	/* the iterator moved past all of it when the pages were mapped */
+	if (mapped && retval < (ssize_t)count)
+		iov_iter_revert(from, count - max_t(ssize_t, retval, 0));
+	if (dio)
+		skel_dio_free(dio);
+	skel_write_slot_put(dev);
+	return retval;
+}
+
+/*
+ * Send len bytes of a filled pool buffer.  On failure the buffer and
+ * its write slot are given back.  With more pieces of the same write
+ * to follow, the urb may go without a completion interrupt: the last
+ * piece, every irq_batch-th one and one that fills the write window
+ * (its writer will wait for a completion) still raise one.
+ */
+static int skel_write_buf_submit(struct usb_skel *dev, struct skel_write_buf *wb,
+				 size_t len, bool more)
+{
+	unsigned int batch = READ_ONCE(irq_batch);
+	struct urb *urb = wb->urb;
+	int retval;
+
+	urb->transfer_buffer_length = len;
+	if (more && batch > 1 && atomic_inc_return(&dev->write_seq) % batch &&
+	    atomic_read(&dev->writes_in_flight) < READ_ONCE(dev->wwin.size))
+		urb->transfer_flags |= URB_NO_INTERRUPT;
+	else
+		urb->transfer_flags &= ~URB_NO_INTERRUPT;
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	usb_anchor_urb(urb, &dev->submitted);
+
+	/* send the data out the bulk port */
+	wb->submitted = ktime_get();
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (!retval)
+		WRITE_ONCE(dev->write_sent, dev->write_sent + 1);
+	mutex_unlock(&dev->io_mutex);
+	if (retval) {
+		dev_err(&dev->udev->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, retval);
+		trace_skel_urb_error(dev->minor, urb, retval);
+		this_cpu_inc(dev->stats->errors[SKEL_ERR_SUBMIT]);
+		goto error_unanchor;
+	}
+	trace_skel_urb_submit(dev->minor, urb,
+			      atomic_read(&dev->writes_in_flight));
+
+	return 0;
+
+error_unanchor:
+	usb_unanchor_urb(urb);
+error:
+	skel_write_buf_put(dev, wb);
+	skel_write_slot_put(dev);
+	return retval;
+}
+
+/*
+ * With write_behind a copied write doesn't wait for a write slot, only
+ * for room in the queue in front of the window.  The queue is sent in
+ * order as slots come free, by whoever queued last or from
+ * behind_work.  Errors end up in dev->errors like those of the urbs.
+ */
+static void skel_write_behind_run(struct usb_skel *dev)
+{
+	struct skel_write_buf *wb;
+	bool more;
+	int retval;
+
+	mutex_lock(&dev->behind_mutex);
+	for (;;) {
+		spin_lock_irq(&dev->behind_lock);
+		wb = list_first_entry_or_null(&dev->behind,
+					      struct skel_write_buf, queue);
+		if (!wb || !skel_write_slot_try(dev)) {
+			spin_unlock_irq(&dev->behind_lock);
+			break;
+		}
+		list_del(&wb->queue);
+		more = !list_empty(&dev->behind);
+		spin_unlock_irq(&dev->behind_lock);
+
+		retval = skel_write_buf_submit(dev, wb, wb->len, more);
+		if (retval < 0 && retval != -ENODEV) {
+			spin_lock_irq(&dev->err_lock);
+			dev->errors = retval;
+			spin_unlock_irq(&dev->err_lock);
+		}
+
+		WRITE_ONCE(dev->behind_out, dev->behind_out + 1);
+		atomic_dec(&dev->behind_nr);
+		wake_up_interruptible_poll(&dev->bulk_out_wait,
+					   EPOLLOUT | EPOLLWRNORM);
+	}
+	mutex_unlock(&dev->behind_mutex);
+}
+
+static void skel_write_behind_work(struct work_struct *work)
+{
+	struct usb_skel *dev = container_of(work, struct usb_skel, behind_work);
+
+	skel_write_behind_run(dev);
+}
+
+/* a write slot, or with write_behind a place in the queue */
+static bool skel_write_room_try(struct usb_skel *dev)
+{
+	if (dev->behind_max)
+		return atomic_add_unless(&dev->behind_nr, 1, dev->behind_max);
+	return skel_write_slot_try(dev);
+}
+
+static int skel_write_room_get(struct usb_skel *dev, struct kiocb *iocb)
+{
+	if (skel_write_room_try(dev))
+		return 0;
+	if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	    (iocb->ki_flags & IOCB_NOWAIT))
+		return -EAGAIN;
+
+	if (wait_event_interruptible(dev->bulk_out_wait,
+				     skel_write_room_try(dev)))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+static void skel_write_room_put(struct usb_skel *dev)
+{
+	if (!dev->behind_max) {
+		skel_write_slot_put(dev);
+		return;
+	}
+	atomic_dec(&dev->behind_nr);
+	wake_up_interruptible_poll(&dev->bulk_out_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+/* send a filled buffer taken with skel_write_room_get() */
+static int skel_write_send(struct usb_skel *dev, struct skel_write_buf *wb,
+			   size_t len, bool more)
+{
+	if (!dev->behind_max)
+		return skel_write_buf_submit(dev, wb, len, more);
+
+	wb->len = len;
+	spin_lock_irq(&dev->behind_lock);
+	list_add_tail(&wb->queue, &dev->behind);
+	dev->behind_in++;
+	spin_unlock_irq(&dev->behind_lock);
+	skel_write_behind_run(dev);
+	return 0;
+}
+
+/*
+ * Wait until every write handed to us so far has been taken by the
+ * device or has failed.  The behind queue is sent in order, and urbs on
+ * the bulk-out endpoint complete in the order they were submitted, so
+ * it is enough to wait for the counts to pass what they were on entry.
+ * Writes that come in meanwhile don't hold us up.
+ */
+static int skel_write_sync(struct usb_skel *dev)
+{
+	unsigned int seq;
+
+	skel_write_flush_pending(dev);
+
+	spin_lock_irq(&dev->behind_lock);
+	seq = dev->behind_in;
+	spin_unlock_irq(&dev->behind_lock);
+	if (wait_event_interruptible(dev->bulk_out_wait,
+			(int)(READ_ONCE(dev->behind_out) - seq) >= 0))
+		return -ERESTARTSYS;
+
+	seq = READ_ONCE(dev->write_sent);
+	if (wait_event_interruptible(dev->bulk_out_wait,
+			(int)(atomic_read(&dev->write_done) - seq) >= 0))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+
+/*
+ * Copy one urb worth of data into a pool buffer and send it.  Only the
+ * first piece of a write() reports errors of earlier writes, later
+ * ones leave them for the next call.
+ */
+static ssize_t skel_write_chunk(struct usb_skel *dev, struct kiocb *iocb,
+				struct iov_iter *from, bool first)
+{
+	size_t writesize = min(iov_iter_count(from), dev->bulk_out_size);
+	struct skel_write_buf *wb;
+	ssize_t retval;
+
+	retval = skel_write_room_get(dev, iocb);
+	if (retval < 0)
+		return retval;
+	wb = skel_write_buf_get(dev);
+	if (!wb) {
+		skel_write_room_put(dev);
+		return -ENOMEM;
+	}
+
+	if (first)
+		retval = skel_write_errors(dev);
+	else if (READ_ONCE(dev->errors) < 0)
+		retval = -EIO;
+	if (retval < 0)
+		goto error;
+
+	/* copy the data to the urb's buffer */
+	if (copy_from_iter(wb->buffer, writesize, from) != writesize) {
+		retval = -EFAULT;
+		goto error;
+	}
+
+	/* a message ends with its write() */
+	if (skel_msg_mode(iocb->ki_filp))
+		wb->urb->transfer_flags |= URB_ZERO_PACKET;
+	else
+		wb->urb->transfer_flags &= ~URB_ZERO_PACKET;
+
+	retval = skel_write_send(dev, wb, writesize, iov_iter_count(from) != 0);
+	return retval < 0 ? retval : writesize;
+
+error:
+	skel_write_buf_put(dev, wb);
+	skel_write_room_put(dev);
+	return retval;
+}
+
+/*
+ * Send what small writes collected.  Their callers were told they
+ * succeeded already, so a failure shows up on the next call.
+ */
+static int skel_write_submit_pending(struct usb_skel *dev)
+{
+	struct skel_write_buf *wb = dev->pending;
+	int retval;
+
+	/* the buffer is gone, its timer must not fire into the next one */
+	cancel_delayed_work(&dev->pending_work);
+	dev->pending = NULL;
+	retval = skel_write_send(dev, wb, dev->pending_len, false);
+	if (retval < 0 && retval != -ENODEV) {
+		spin_lock_irq(&dev->err_lock);
+		dev->errors = retval;
+		spin_unlock_irq(&dev->err_lock);
+	}
+
+	return retval;
+}
+
+static void skel_write_flush_pending(struct usb_skel *dev)
+{
+	mutex_lock(&dev->pending_mutex);
+	if (dev->pending)
+		skel_write_submit_pending(dev);
+	mutex_unlock(&dev->pending_mutex);
+}
+
+/* coalesce_usecs passed since the first write went into the buffer */
+static void skel_write_pending_expired(struct work_struct *work)
+{
+	struct usb_skel *dev = container_of(work, struct usb_skel,
+					    pending_work.work);
+
+	skel_write_flush_pending(dev);
+}
+
+/*
+ * Append a small write to the pending buffer, which goes out once it
+ * holds limit bytes, when coalesce_usecs pass, or on flush.
+ */
+static ssize_t skel_write_coalesce(struct usb_skel *dev, struct kiocb *iocb,
+				   struct iov_iter *from, size_t limit)
+{
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	ssize_t retval;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&dev->pending_mutex))
+			return -EAGAIN;
+	} else {
+		retval = mutex_lock_interruptible(&dev->pending_mutex);
+		if (retval < 0)
+			return retval;
+	}
+
+	retval = skel_write_errors(dev);
+	if (retval < 0)
+		goto exit;
+
+	/* no room left, send what we have and start over */
+	if (dev->pending && dev->pending_len + count > dev->bulk_out_size)
+		skel_write_submit_pending(dev);
+
+	if (!dev->pending) {
+		retval = skel_write_room_get(dev, iocb);
+		if (retval < 0)
+			goto exit;
+		dev->pending = skel_write_buf_get(dev);
+		if (!dev->pending) {
+			skel_write_room_put(dev);
+			retval = -ENOMEM;
+			goto exit;
+		}
+		dev->pending->urb->transfer_flags &= ~URB_ZERO_PACKET;
+		dev->pending_len = 0;
+		mod_delayed_work(system_wq, &dev->pending_work,
+				 usecs_to_jiffies(coalesce_usecs));
+	}
+
+	copied = copy_from_iter(dev->pending->buffer + dev->pending_len,
+				count, from);
+	dev->pending_len += copied;
+	retval = copied ? copied : -EFAULT;
+
+	if (dev->pending_len >= limit) {
+		skel_write_submit_pending(dev);
+	} else if (!dev->pending_len) {
+		/* nothing to send, don't let the timer send a zero length packet */
+		skel_write_buf_put(dev, dev->pending);
+		skel_write_room_put(dev);
+		dev->pending = NULL;
+		cancel_delayed_work(&dev->pending_work);
+	}
+
+exit:
+	mutex_unlock(&dev->pending_mutex);
+	return retval;
+}
+
+/* the largest write that still goes out as a single urb */
+static size_t skel_write_msg_max(struct usb_skel *dev, struct kiocb *iocb,
+				 struct iov_iter *from)
+{
+	if ((!is_sync_kiocb(iocb) || !dev->behind_max) &&
+	    skel_write_direct_ok(dev, from))
+		return WRITE_DIRECT_MAX;
+	return dev->bulk_out_size;
+}
+
+static ssize_t skel_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct usb_skel *dev;
+	ssize_t retval = 0;
+	size_t count = iov_iter_count(from);
+	size_t written = 0;
+	size_t limit;
+
+	dev = skel_file_dev(file);
+
+	/* verify that we actually have some data to write */
+	if (count == 0)
+		goto exit;
+
+	/* a message must fit into one urb, and isn't mixed with others */
+	if (skel_msg_mode(file)) {
+		if (count > skel_write_msg_max(dev, iocb, from)) {
+			retval = -EMSGSIZE;
+			goto exit;
+		}
+		limit = 0;
+	} else {
+		limit = min_t(size_t, READ_ONCE(coalesce_size),
+			      dev->bulk_out_size);
+	}
+	if (is_sync_kiocb(iocb) && count < limit) {
+		retval = skel_write_coalesce(dev, iocb, from, limit);
+		goto exit;
+	}
+
+	/* collected writes go out ahead of this one */
+	if (READ_ONCE(dev->pending))
+		skel_write_flush_pending(dev);
+
+	if (!is_sync_kiocb(iocb)) {
+		retval = skel_write_async(dev, iocb, from);
+		goto exit;
+	}
+
+	/*
+	 * send it all as a chain of urbs, waiting for write slots as they
+	 * come free, and stop short only for signals, O_NONBLOCK or errors.
+	 * Pipe pages, writev() segments and large buffers go out without
+	 * a copy, the rest through the pool buffers.  With write_behind
+	 * everything is copied, so that write() never waits for the bus.
+	 */
+	while (iov_iter_count(from)) {
+		size_t want = iov_iter_count(from);
+
+		if (!dev->behind_max && skel_write_direct_ok(dev, from)) {
+			want = min_t(size_t, want, WRITE_DIRECT_MAX);
+			retval = skel_write_direct(dev, iocb, from, !written);
+		} else {
+			want = min(want, dev->bulk_out_size);
+			retval = skel_write_chunk(dev, iocb, from, !written);
+		}
+		if (retval < 0)
+			break;
+		written += retval;
+		/* the device stopped short, later data must not follow it */
+		if (retval < want)
+			break;
+	}
+	if (written)
+		retval = written;
+
+exit:
+	trace_skel_write(dev->minor, count, iocb->ki_flags, retval);
+	return skel_stat_ret(dev, retval);
+}
+
+/*
+ * The barrier for write_behind, but good without it too: returns once
+ * the device took all data written before, or reports what went wrong.
+ */
+static int skel_fsync(struct file *file, loff_t start, loff_t end,
+		      int datasync)
+{
+	struct usb_skel *dev = skel_file_dev(file);
+	int retval;
+
+	retval = skel_write_sync(dev);
+	if (retval < 0)
+		return retval;
+
+	retval = skel_write_errors(dev);
+	if (!retval && !dev->interface)		/* disconnect() was called */
+		retval = -ENODEV;
+	return retval;
+}
+
+static void skel_vm_open(struct vm_area_struct *vma)
+{
+	struct usb_skel *dev = vma->vm_private_data;
+
+	spin_lock_irq(&dev->read_lock);
+	dev->read_mapped++;
+	spin_unlock_irq(&dev->read_lock);
+	kref_get(&dev->kref);
+}
+
+static void skel_vm_close(struct vm_area_struct *vma)
+{
+	struct usb_skel *dev = vma->vm_private_data;
+
+	spin_lock_irq(&dev->read_lock);
+	dev->read_mapped--;
+	spin_unlock_irq(&dev->read_lock);
+	kref_put(&dev->kref, skel_delete);
+}
+
+static const struct vm_operations_struct skel_vm_ops = {
+	.open =		skel_vm_open,
+	.close =	skel_vm_close,
+};
+
+static unsigned long skel_ring_mmap_size(struct usb_skel *dev)
+{
+	return PAGE_SIZE + (unsigned long)dev->read_nr * READ_PAGES(dev) *
+	       PAGE_SIZE;
+}
+
+/* queue the ring for a consumer that doesn't go through skel_read_iter */
+static int skel_ring_start(struct usb_skel *dev)
+{
+	int rv = -ENODEV;
+
+	spin_lock_irq(&dev->read_lock);
+	if (dev->interface) {
+		dev->read_running = true;
+		rv = skel_read_refill(dev);
+	}
+	spin_unlock_irq(&dev->read_lock);
+
+	return rv;
+}
+
+/*
+ * Map the control page followed by the pages of every slot, so the
+ * application reads the data where the host controller put it.  A ring
+ * that read() consumes can't be mapped, it would lose slots to it.
+ * mmap_lock is held, so read_mutex can't be taken here: readers fault
+ * on user memory with it held.
+ */
+static int skel_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct usb_skel *dev;
+	struct skel_ring_ctrl *ctrl = NULL;
+	unsigned long addr = vma->vm_start;
+	unsigned int i, j;
+	int rv = 0;
+
+	dev = skel_file_dev(file);
+	if (!dev->read_slots)
+		return -ENODEV;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > skel_ring_mmap_size(dev))
+		return -EINVAL;
+
+	if (!READ_ONCE(dev->ring_ctrl)) {
+		ctrl = (struct skel_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+		if (!ctrl)
+			return -ENOMEM;
+		ctrl->nr_slots = dev->read_nr;
+		ctrl->slot_size = dev->bulk_in_size;
+		ctrl->slot_stride = READ_PAGES(dev) * PAGE_SIZE;
+		ctrl->data_offset = PAGE_SIZE;
+	}
+
+	/* counting the mapping now keeps read() out from here on */
+	spin_lock_irq(&dev->read_lock);
+	if (dev->read_syscall) {
+		rv = -EBUSY;
+	} else {
+		if (ctrl && !dev->ring_ctrl) {
+			ctrl->head = dev->read_done;
+			ctrl->tail = dev->read_consumed;
+			dev->ring_ctrl = ctrl;
+			ctrl = NULL;
+		}
+		dev->read_mapped++;
+	}
+	spin_unlock_irq(&dev->read_lock);
+	/* lost the race to another mmap(), or refused */
+	if (ctrl)
+		free_page((unsigned long)ctrl);
+	if (rv)
+		return rv;
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	rv = vm_insert_page(vma, addr, virt_to_page(dev->ring_ctrl));
+	addr += PAGE_SIZE;
+	for (i = 0; !rv && i < dev->read_nr; i++) {
+		for (j = 0; !rv && j < READ_PAGES(dev); j++) {
+			if (addr >= vma->vm_end)
+				break;
+			rv = vm_insert_page(vma, addr,
+					    skel_slot_page(dev, &dev->read_slots[i], j));
+			addr += PAGE_SIZE;
+		}
+	}
+	if (rv) {
+		spin_lock_irq(&dev->read_lock);
+		dev->read_mapped--;
+		spin_unlock_irq(&dev->read_lock);
+		return rv;
+	}
+
+	/* from here on skel_vm_close() drops the count and the reference */
+	vma->vm_ops = &skel_vm_ops;
+	vma->vm_private_data = dev;
+	kref_get(&dev->kref);
+
+	/* failures to queue are reported by SKEL_IOC_RING_WAIT */
+	skel_ring_start(dev);
+	return 0;
+}
+
+/* hand released slots back and sleep until the ring holds data */
+static int skel_ring_wait(struct usb_skel *dev, struct file *file)
+{
+	bool ready, pending;
+	int rv;
+
+	if (!dev->read_mapped)
+		return -EINVAL;
+
+	rv = skel_ring_start(dev);
+	if (rv == -ENODEV)
+		return rv;
+
+	spin_lock_irq(&dev->read_lock);
+	ready = dev->read_done != dev->read_consumed;
+	pending = dev->read_posted != dev->read_consumed;
+	spin_unlock_irq(&dev->read_lock);
+	if (ready)
+		return 0;
+
+	/* nothing queued and we could not queue anything */
+	if (!pending)
+		return (rv == -ENOMEM) ? rv : -EIO;
+
+	/* nonblocking IO shall not wait */
+	if (file->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+
+	rv = wait_event_interruptible(dev->bulk_in_wait, skel_read_ready(dev));
+	if (rv < 0)
+		return rv;
+
+	/* the ring was torn down under us */
+	return dev->read_running ? 0 : -EIO;
+}
+
+static long skel_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct skel_file *sf = file->private_data;
+	struct usb_skel *dev = sf->dev;
+	void __user *argp = (void __user *)arg;
+	struct skel_msg_info info;
+	u32 mode;
+
+	switch (cmd) {
+	case SKEL_IOC_RING_WAIT:
+		return skel_ring_wait(dev, file);
+	case SKEL_IOC_SET_MODE:
+		if (get_user(mode, (u32 __user *)argp))
+			return -EFAULT;
+		if (mode != SKEL_MODE_STREAM && mode != SKEL_MODE_MSG)
+			return -EINVAL;
+		WRITE_ONCE(sf->mode, mode);
+		return 0;
+	case SKEL_IOC_MSG_INFO:
+		/* read_mutex keeps a read from changing it halfway */
+		if (mutex_lock_interruptible(&dev->read_mutex))
+			return -ERESTARTSYS;
+		info = sf->msg;
+		mutex_unlock(&dev->read_mutex);
+		return copy_to_user(argp, &info, sizeof(info)) ? -EFAULT : 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Readable once a slot of the ring has completed, writable while
+ * the write window has a slot left.  Polling for input starts the ring just
+ * like the first read would.
+ */
+static __poll_t skel_poll(struct file *file, poll_table *wait)
+{
+	struct usb_skel *dev;
+	__poll_t mask = 0;
+
+	dev = skel_file_dev(file);
+
+	poll_wait(file, &dev->bulk_in_wait, wait);
+	poll_wait(file, &dev->bulk_out_wait, wait);
+
+	/* disconnect() clears the interface under read_lock */
+	spin_lock_irq(&dev->read_lock);
+	if (!dev->interface) {
+		spin_unlock_irq(&dev->read_lock);
+		return EPOLLERR | EPOLLHUP;
+	}
+	if (dev->read_slots && (file->f_mode & FMODE_READ)) {
+		dev->read_running = true;
+		skel_read_refill(dev);
+		if (dev->read_done != dev->read_consumed)
+			mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	spin_unlock_irq(&dev->read_lock);
+
+	spin_lock_irq(&dev->err_lock);
+	if (dev->errors)
+		mask |= EPOLLERR;
+	spin_unlock_irq(&dev->err_lock);
+
+	if (dev->behind_max ?
+	    atomic_read(&dev->behind_nr) < dev->behind_max :
+	    atomic_read(&dev->writes_in_flight) < READ_ONCE(dev->wwin.size))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static const struct file_operations skel_fops = {
+	.owner =	THIS_MODULE,
+	.read_iter =	skel_read_iter,
+	.write_iter =	skel_write_iter,
+	.splice_read =	skel_splice_read,
+	.splice_write =	iter_file_splice_write,
+	.open =		skel_open,
+	.release =	skel_release,
+	.flush =	skel_flush,
+	.fsync =	skel_fsync,
+	.poll =		skel_poll,
+	.mmap =		skel_mmap,
+	.unlocked_ioctl = skel_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+	.llseek =	noop_llseek,
+};
+
+/*
+ * Size the bulk-in transfers: read_size rounded to whole pages, no more
+ * pages than the host controller takes in one sg list, and a multiple
+ * of the packet size so a full transfer never babbles.
+ */
+static size_t skel_read_transfer_size(struct usb_skel *dev, size_t maxp)
+{
+	unsigned int sg_tablesize = dev->udev->bus->sg_tablesize;
+	size_t size;
+
+	if (!maxp)
+		return 0;
+
+	size = PAGE_ALIGN(clamp_t(size_t, read_size, READ_SIZE_MIN,
+				  READ_SIZE_MAX));
+	if (sg_tablesize)
+		size = min_t(size_t, size, (size_t)sg_tablesize << PAGE_SHIFT);
+	else
+		size = min_t(size_t, size, READ_LINEAR_MAX);
+
+	return rounddown(size, maxp);
+}
+
+/* back one slot with single pages in an sg list, or one contiguous chunk */
+static int skel_alloc_read_buffer(struct usb_skel *dev,
+				  struct skel_read_slot *slot)
+{
+	unsigned int nr_pages = READ_PAGES(dev);
+	size_t left = dev->bulk_in_size;
+	struct page *page;
+	unsigned int i;
+
+	if (!dev->udev->bus->sg_tablesize) {
+		slot->buffer = alloc_pages_exact(dev->bulk_in_size, GFP_KERNEL);
+		return slot->buffer ? 0 : -ENOMEM;
+	}
+
+	slot->sg = kmalloc_array(nr_pages, sizeof(*slot->sg), GFP_KERNEL);
+	if (!slot->sg)
+		return -ENOMEM;
+	sg_init_table(slot->sg, nr_pages);
+
+	for (i = 0; i < nr_pages; i++) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			return -ENOMEM;
+		sg_set_page(&slot->sg[i], page, min_t(size_t, left, PAGE_SIZE), 0);
+		left -= slot->sg[i].length;
+	}
+
+	return 0;
+}
+
+/* set up the bulk-in ring, one urb and one buffer per slot */
+static int skel_alloc_read_slots(struct usb_skel *dev, size_t maxp)
+{
+	struct skel_read_slot *slot;
+	unsigned int i;
+
+	dev->bulk_in_size = skel_read_transfer_size(dev, maxp);
+	if (!dev->bulk_in_size) {
+		dev_err(&dev->interface->dev,
+			"bulk-in packet size %zu is too large\n", maxp);
+		return -EINVAL;
+	}
+
+	dev->read_nr = clamp(read_urbs, 1U, (unsigned int)READ_URBS_MAX);
+	dev->read_slots = kcalloc(dev->read_nr, sizeof(*dev->read_slots),
+				  GFP_KERNEL);
+	if (!dev->read_slots) {
+		dev_err(&dev->interface->dev, "Could not allocate read_slots\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < dev->read_nr; i++) {
+		slot = &dev->read_slots[i];
+		slot->dev = dev;
+
+		if (skel_alloc_read_buffer(dev, slot)) {
+			dev_err(&dev->interface->dev, "Could not allocate bulk_in_buffer\n");
+			return -ENOMEM;
+		}
+
+		// 使用 usb_alloc_urb 建立一個 urb
+		// struct urb 可在include/linux/usb.h 找到
+		slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!slot->urb) {
+			dev_err(&dev->interface->dev, "Could not allocate bulk_in_urb\n");
+			return -ENOMEM;
+		}
+
+		/* every slot always reads into the same buffer */
+		usb_fill_bulk_urb(slot->urb, dev->udev,
+				  usb_rcvbulkpipe(dev->udev,
+						  dev->bulk_in_endpointAddr),
+				  slot->buffer, dev->bulk_in_size,
+				  skel_read_bulk_callback, slot);
+		if (slot->sg) {
+			slot->urb->sg = slot->sg;
+			slot->urb->num_sgs = READ_PAGES(dev);
+		}
+	}
+
+	return 0;
+}
+
+static const char * const skel_err_names[SKEL_ERR_MAX] = {
+	[SKEL_ERR_SUBMIT]	= "submit",
+	[SKEL_ERR_UNLINK]	= "unlink",
+	[SKEL_ERR_SHUTDOWN]	= "shutdown",
+	[SKEL_ERR_EPIPE]	= "epipe",
+	[SKEL_ERR_EPROTO]	= "eproto",
+	[SKEL_ERR_EILSEQ]	= "eilseq",
+	[SKEL_ERR_ETIME]	= "etime",
+	[SKEL_ERR_EOVERFLOW]	= "eoverflow",
+	[SKEL_ERR_EREMOTEIO]	= "eremoteio",
+	[SKEL_ERR_OTHER]	= "other",
+};
+
+/* add up what every CPU counted */
+static void skel_stats_sum(struct usb_skel *dev, struct skel_stats *sum)
+{
+	const u64 *v;
+	u64 *t;
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		v = (const u64 *)per_cpu_ptr(dev->stats, cpu);
+		t = (u64 *)sum;
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+			t[i] += READ_ONCE(v[i]);
+	}
+}
+
+static int skel_stats_show(struct seq_file *m, void *unused)
+{
+	struct usb_skel *dev = m->private;
+	struct skel_stats *sum;
+	unsigned int i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	skel_stats_sum(dev, sum);
+
+	seq_printf(m, "bytes_in %llu\n", sum->bytes[SKEL_IN]);
+	seq_printf(m, "bytes_out %llu\n", sum->bytes[SKEL_OUT]);
+	seq_printf(m, "urbs_in %llu\n", sum->urbs[SKEL_IN]);
+	seq_printf(m, "urbs_out %llu\n", sum->urbs[SKEL_OUT]);
+	seq_printf(m, "short_in %llu\n", sum->short_xfers[SKEL_IN]);
+	seq_printf(m, "short_out %llu\n", sum->short_xfers[SKEL_OUT]);
+	seq_printf(m, "eagain %llu\n", sum->eagain);
+	seq_printf(m, "read_kicks %llu\n", sum->read_kicks);
+	seq_printf(m, "writes_in_flight %d\n", atomic_read(&dev->writes_in_flight));
+	seq_printf(m, "writes_peak %d\n", atomic_read(&dev->writes_peak));
+	seq_printf(m, "write_behind %d\n", atomic_read(&dev->behind_nr));
+	seq_printf(m, "write_window %u\n", READ_ONCE(dev->wwin.size));
+	seq_printf(m, "write_window_min %u\n", READ_ONCE(dev->wwin.min));
+	seq_printf(m, "write_window_max %u\n", READ_ONCE(dev->wwin.max));
+	seq_printf(m, "write_latency_floor_us %llu\n",
+		   div_u64(READ_ONCE(dev->wwin.lat_min), NSEC_PER_USEC));
+	for (i = 0; i < SKEL_ERR_MAX; i++)
+		seq_printf(m, "err_%s %llu\n", skel_err_names[i], sum->errors[i]);
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(skel_stats);
+
+static int skel_latency_show(struct seq_file *m, void *unused)
+{
+	struct usb_skel *dev = m->private;
+	struct skel_stats *sum;
+	unsigned int i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	skel_stats_sum(dev, sum);
+
+	/* each row counts latencies below its bound, the last one the rest */
+	seq_printf(m, "%-12s %12s %12s\n", "usecs", "submit", "wakeup");
+	for (i = 0; i < SKEL_LAT_BUCKETS; i++) {
+		if (i < SKEL_LAT_BUCKETS - 1)
+			seq_printf(m, "<%-11lu", 1UL << i);
+		else
+			seq_printf(m, ">=%-10lu", 1UL << (i - 1));
+		seq_printf(m, " %12llu %12llu\n", sum->submit_lat[i],
+			   sum->wake_lat[i]);
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(skel_latency);
+
+/* /sys/kernel/debug/eric_usb/skelN/ */
+static void skel_debugfs_init(struct usb_skel *dev)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "skel%d", dev->minor);
+	dev->debugfs = debugfs_create_dir(name, skel_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+			    &skel_stats_fops);
+	debugfs_create_file("latency", 0444, dev->debugfs, dev,
+			    &skel_latency_fops);
+}
+
+/* one urb and buffer per write slot, writes in a steady window never allocate */
+static int skel_alloc_write_bufs(struct usb_skel *dev)
+{
+	struct skel_write_buf *wb;
+	unsigned int i;
+
+	/* whole packets, a short one would end the transfer early */
+	dev->bulk_out_size = clamp_t(size_t, write_size, PAGE_SIZE,
+				     READ_LINEAR_MAX);
+	if (dev->bulk_out_maxp)
+		dev->bulk_out_size = rounddown(dev->bulk_out_size,
+					       dev->bulk_out_maxp);
+	if (!dev->bulk_out_size) {
+		dev_err(&dev->interface->dev,
+			"bulk-out packet size %zu is too large\n",
+			dev->bulk_out_maxp);
+		return -EINVAL;
+	}
+
+	dev->behind_max = DIV_ROUND_UP(write_behind, dev->bulk_out_size);
+
+	/* enough for the initial window, more come as it grows */
+	for (i = 0; i < WRITES_IN_FLIGHT; i++) {
+		wb = skel_alloc_write_buf(dev);
+		if (!wb)
+			return -ENOMEM;
+		llist_add(&wb->node, &dev->write_pool);
+	}
+
+	return 0;
+}
+
+/*
+ * Bulk-Only Transport
+ *
+ * Mass-storage devices get no /dev/skelN character device.  They get a
+ * blk-mq disk /dev/skelbN instead, numbered apart from the character
+ * devices so the names never clash, and we speak SCSI to them:
+ * each command is a CBW on bulk-out, an optional data stage and a CSW
+ * on bulk-in.  The protocol allows only one command at a time, so the
+ * tag set has a depth of one.  Requests waiting behind it stay in the
+ * scheduler and merge there.  Commands run from an ordered workqueue
+ * with usb_sg_wait(), and a timer aborts one that hangs.
+ */
+static void skel_bot_urb_done(struct urb *urb)
+{
+	struct skel_bot *bot = urb->context;
+
+	complete(&bot->done);
+}
+
+/* stop the transfer in progress, the command fails with -ECONNRESET */
+static void skel_bot_abort(struct skel_bot *bot)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bot->lock, flags);
+	bot->aborted = true;
+	if (bot->stage == SKEL_BOT_URB)
+		usb_unlink_urb(bot->urb);
+	else if (bot->stage == SKEL_BOT_SG)
+		usb_sg_cancel(&bot->sg);
+	spin_unlock_irqrestore(&bot->lock, flags);
+}
+
+static void skel_bot_timeout(struct timer_list *t)
+{
+	struct skel_bot *bot = from_timer(bot, t, timer);
+
+	skel_bot_abort(bot);
+}
+
+/* send a CBW or receive a CSW */
+static int skel_bot_urb(struct skel_bot *bot, unsigned int pipe, void *buf,
+			unsigned int len, unsigned int *actual)
+{
+	struct urb *urb = bot->urb;
+	int rv;
+
+	usb_fill_bulk_urb(urb, bot->dev->udev, pipe, buf, len,
+			  skel_bot_urb_done, bot);
+	reinit_completion(&bot->done);
+
+	spin_lock_irq(&bot->lock);
+	if (bot->aborted) {
+		spin_unlock_irq(&bot->lock);
+		return -ECONNRESET;
+	}
+	bot->stage = SKEL_BOT_URB;
+	spin_unlock_irq(&bot->lock);
+
+	rv = usb_submit_urb(urb, GFP_NOIO);
+	if (!rv) {
+		/* an abort while we submitted found nothing to unlink */
+		if (READ_ONCE(bot->aborted))
+			usb_unlink_urb(urb);
+		wait_for_completion(&bot->done);
+		rv = urb->status;
+		*actual = urb->actual_length;
+	}
+
+	spin_lock_irq(&bot->lock);
+	bot->stage = SKEL_BOT_IDLE;
+	spin_unlock_irq(&bot->lock);
+
+	return rv;
+}
+
+/* the data stage, as many urbs as the host controller needs */
+static int skel_bot_sg(struct skel_bot *bot, unsigned int pipe,
+		       struct scatterlist *sg, int nents, unsigned int len,
+		       unsigned int *actual)
+{
+	int rv;
+
+	rv = usb_sg_init(&bot->sg, bot->dev->udev, pipe, 0, sg, nents, len,
+			 GFP_NOIO);
+	if (rv)
+		return rv;
+
+	spin_lock_irq(&bot->lock);
+	bot->stage = SKEL_BOT_SG;
+	/* usb_sg_wait() won't submit what was cancelled */
+	if (bot->aborted)
+		usb_sg_cancel(&bot->sg);
+	spin_unlock_irq(&bot->lock);
+
+	usb_sg_wait(&bot->sg);
+
+	spin_lock_irq(&bot->lock);
+	bot->stage = SKEL_BOT_IDLE;
+	spin_unlock_irq(&bot->lock);
+
+	*actual = bot->sg.bytes;
+	return bot->sg.status;
+}
+
+/* Bulk-Only Mass Storage Reset, then both endpoints are unstalled */
+static void skel_bot_reset(struct skel_bot *bot)
+{
+	struct usb_skel *dev = bot->dev;
+	int rv;
+
+	if (READ_ONCE(bot->dead))
+		return;
+
+	rv = usb_control_msg(dev->udev, usb_sndctrlpipe(dev->udev, 0),
+			     US_BULK_RESET_REQUEST,
+			     USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+			     0, bot->ifnum, NULL, 0, USB_CTRL_SET_TIMEOUT);
+	if (rv < 0)
+		dev_err(&dev->udev->dev,
+			"%s - mass storage reset failed, error %d\n",
+			__func__, rv);
+
+	usb_clear_halt(dev->udev,
+		       usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+	usb_clear_halt(dev->udev,
+		       usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr));
+}
+
+/*
+ * One command, CBW to CSW.  Returns 0, -EREMOTEIO if the device says
+ * the command failed, or another error once the transport has been
+ * reset.  *residue is what the device didn't transfer.
+ */
+static int skel_bot_transport(struct skel_bot *bot, u8 lun, const u8 *cdb,
+			      unsigned int cdb_len, bool in,
+			      struct scatterlist *sg, int nents,
+			      unsigned int len, unsigned int *residue)
+{
+	struct usb_skel *dev = bot->dev;
+	unsigned int in_pipe = usb_rcvbulkpipe(dev->udev,
+					       dev->bulk_in_endpointAddr);
+	unsigned int out_pipe = usb_sndbulkpipe(dev->udev,
+						dev->bulk_out_endpointAddr);
+	struct bulk_cb_wrap *cbw = bot->iobuf;
+	struct bulk_cs_wrap *csw = bot->iobuf;
+	unsigned int actual, moved = 0;
+	int rv;
+
+	memset(cbw, 0, sizeof(*cbw));
+	cbw->Signature = cpu_to_le32(US_BULK_CB_SIGN);
+	cbw->Tag = cpu_to_le32(++bot->tag);
+	cbw->DataTransferLength = cpu_to_le32(len);
+	cbw->Flags = in ? US_BULK_FLAG_IN : 0;
+	cbw->Lun = lun;
+	cbw->Length = cdb_len;
+	memcpy(cbw->CDB, cdb, cdb_len);
+
+	rv = skel_bot_urb(bot, out_pipe, cbw, US_BULK_CB_WRAP_LEN, &actual);
+	if (rv)
+		goto reset;
+
+	if (len) {
+		rv = skel_bot_sg(bot, in ? in_pipe : out_pipe, sg, nents, len,
+				 &moved);
+		/* the device stalls what it won't transfer, the CSW follows */
+		if (rv == -EPIPE)
+			rv = usb_clear_halt(dev->udev, in ? in_pipe : out_pipe);
+		if (rv)
+			goto reset;
+	}
+
+	rv = skel_bot_urb(bot, in_pipe, csw, US_BULK_CS_WRAP_LEN, &actual);
+	if (rv == -EPIPE) {
+		/* a stall instead of the CSW, it may come on the second try */
+		rv = usb_clear_halt(dev->udev, in_pipe);
+		if (!rv)
+			rv = skel_bot_urb(bot, in_pipe, csw,
+					  US_BULK_CS_WRAP_LEN, &actual);
+	}
+	if (rv)
+		goto reset;
+
+	if (actual < US_BULK_CS_WRAP_LEN ||
+	    csw->Signature != cpu_to_le32(US_BULK_CS_SIGN) ||
+	    csw->Tag != cpu_to_le32(bot->tag) || csw->Status > US_BULK_STAT_FAIL) {
+		dev_err(&dev->udev->dev, "%s - invalid CSW, status %u\n",
+			__func__, csw->Status);
+		rv = -EIO;
+		goto reset;
+	}
+
+	*residue = max(min(le32_to_cpu(csw->Residue), len), len - moved);
+	return csw->Status == US_BULK_STAT_FAIL ? -EREMOTEIO : 0;
+
+reset:
+	skel_bot_reset(bot);
+	return rv;
+}
+
+/* the key of fixed or descriptor format sense data */
+static int skel_sense_key(const u8 *sense)
+{
+	/* descriptor format keeps the key in byte 1, fixed format in byte 2 */
+	if ((sense[0] & 0x7f) >= 0x72)
+		return sense[1] & 0xf;
+	return sense[2] & 0xf;
+}
+
+/* REQUEST SENSE after a failed command, returns the sense key */
+static int skel_bot_sense(struct skel_bot *bot, u8 lun)
+{
+	u8 cdb[6] = { REQUEST_SENSE, 0, 0, 0, SKEL_BOT_SENSE_LEN, 0 };
+	unsigned int residue;
+	struct scatterlist sg;
+	u8 *sense = bot->sense;
+	int rv;
+
+	memset(sense, 0, SKEL_BOT_SENSE_LEN);
+	sg_init_one(&sg, sense, SKEL_BOT_SENSE_LEN);
+	rv = skel_bot_transport(bot, lun, cdb, sizeof(cdb), true, &sg, 1,
+				SKEL_BOT_SENSE_LEN, &residue);
+	if (rv)
+		return rv;
+	return skel_sense_key(sense);
+}
+
+/*
+ * Run a command with the transport to ourselves.  Returns 0, the sense
+ * key of a failed command, or a negative error.  The command is
+ * aborted after timeout jiffies.
+ */
+static int skel_bot_command(struct skel_bot *bot, u8 lun, const u8 *cdb,
+			    unsigned int cdb_len, bool in,
+			    struct scatterlist *sg, int nents,
+			    unsigned int len, unsigned int *residue,
+			    unsigned long timeout)
+{
+	int rv;
+
+	mutex_lock(&bot->mutex);
+	if (bot->stopped) {
+		mutex_unlock(&bot->mutex);
+		return -EAGAIN;
+	}
+	spin_lock_irq(&bot->lock);
+	bot->aborted = bot->dead;
+	spin_unlock_irq(&bot->lock);
+
+	mod_timer(&bot->timer, jiffies + timeout);
+	rv = skel_bot_transport(bot, lun, cdb, cdb_len, in, sg, nents, len,
+				residue);
+	if (rv == -EREMOTEIO) {
+		rv = skel_bot_sense(bot, lun);
+		/* failed without saying why */
+		if (rv == NO_SENSE)
+			rv = -EIO;
+	}
+	del_timer_sync(&bot->timer);
+	mutex_unlock(&bot->mutex);
+
+	return rv;
+}
+
+static int skel_uas_simple(struct skel_lun *lun, const u8 *cdb,
+			   unsigned int cdb_len, unsigned int len);
+
+/* a command of our own, data in from the device into bot->buf */
+static int skel_bot_simple(struct skel_lun *lun, const u8 *cdb,
+			   unsigned int cdb_len, unsigned int len)
+{
+	struct skel_bot *bot = lun->bot;
+	unsigned int residue;
+	struct scatterlist sg;
+
+	if (bot->uas)
+		return skel_uas_simple(lun, cdb, cdb_len, len);
+
+	sg_init_one(&sg, bot->buf, SKEL_BOT_BUF);
+	return skel_bot_command(bot, lun->lun, cdb, cdb_len, true, &sg, 1, len,
+				&residue, SKEL_BOT_TIMEOUT);
+}
+
+static unsigned int skel_bot_rw_cdb(u8 *cdb, bool write, u64 lba, u32 blocks)
+{
+	if (lba <= U32_MAX && blocks <= U16_MAX) {
+		cdb[0] = write ? WRITE_10 : READ_10;
+		put_unaligned_be32(lba, &cdb[2]);
+		put_unaligned_be16(blocks, &cdb[7]);
+		return 10;
+	}
+
+	cdb[0] = write ? WRITE_16 : READ_16;
+	put_unaligned_be64(lba, &cdb[2]);
+	put_unaligned_be32(blocks, &cdb[10]);
+	return 16;
+}
+
+/*
+ * A discard or write zeroes: UNMAP with its parameter list, or WRITE
+ * SAME with one block of zeros.  Sets up cmd->sg and cmd->len for the
+ * data-out stage and returns the length of the CDB.
+ */
+static unsigned int skel_bot_zero_cdb(struct skel_lun *lun,
+				      struct request *rq,
+				      struct skel_bot_cmd *cmd, u8 *cdb)
+{
+	u64 lba = blk_rq_pos(rq) >> (lun->block_shift - SECTOR_SHIFT);
+	u32 blocks = blk_rq_bytes(rq) >> lun->block_shift;
+	bool discard = req_op(rq) == REQ_OP_DISCARD;
+	u8 *p = cmd->param;
+
+	if (discard && lun->discard == SKEL_DISCARD_UNMAP) {
+		memset(p, 0, SKEL_UNMAP_LEN);
+		put_unaligned_be16(SKEL_UNMAP_LEN - 2, &p[0]);
+		put_unaligned_be16(16, &p[2]);
+		put_unaligned_be64(lba, &p[8]);
+		put_unaligned_be32(blocks, &p[16]);
+		sg_init_one(cmd->sg, p, SKEL_UNMAP_LEN);
+		cmd->len = SKEL_UNMAP_LEN;
+
+		cdb[0] = UNMAP;
+		put_unaligned_be16(SKEL_UNMAP_LEN, &cdb[7]);
+		return 10;
+	}
+
+	cmd->len = 1 << lun->block_shift;
+	sg_init_table(cmd->sg, 1);
+	sg_set_page(cmd->sg, ZERO_PAGE(0), cmd->len, 0);
+	/* the UNMAP bit, zeroing must keep the blocks allocated */
+	if (discard)
+		cdb[1] = 0x08;
+
+	if (lun->ws10) {
+		cdb[0] = WRITE_SAME;
+		put_unaligned_be32(lba, &cdb[2]);
+		put_unaligned_be16(blocks, &cdb[7]);
+		return 10;
+	}
+	cdb[0] = WRITE_SAME_16;
+	put_unaligned_be64(lba, &cdb[2]);
+	put_unaligned_be32(blocks, &cdb[10]);
+	return 16;
+}
+
+/* what the block layer is told about a command that ran */
+static blk_status_t skel_bot_status(struct request *rq, int rv,
+				    unsigned int residue)
+{
+	/* devices without a cache may not know the command */
+	if (rv == ILLEGAL_REQUEST && req_op(rq) == REQ_OP_FLUSH)
+		return BLK_STS_OK;
+	/* nor one that claimed to have it; zeroout then writes the zeros */
+	if (rv == ILLEGAL_REQUEST && req_op(rq) == REQ_OP_WRITE_ZEROES) {
+		blk_queue_max_write_zeroes_sectors(rq->q, 0);
+		return BLK_STS_NOTSUPP;
+	}
+	if (rv == ILLEGAL_REQUEST && req_op(rq) == REQ_OP_DISCARD) {
+		blk_queue_max_discard_sectors(rq->q, 0);
+		return BLK_STS_NOTSUPP;
+	}
+	if (rv || residue)
+		return BLK_STS_IOERR;
+	return BLK_STS_OK;
+}
+
+/* how long the device may take for a request */
+static unsigned long skel_bot_rq_time(struct request *rq)
+{
+	if (req_op(rq) == REQ_OP_DISCARD || req_op(rq) == REQ_OP_WRITE_ZEROES)
+		return SKEL_BOT_ZERO_TIMEOUT;
+	return SKEL_BOT_TIMEOUT;
+}
+
+static blk_status_t skel_bot_execute(struct skel_lun *lun, struct request *rq,
+				     struct skel_bot_cmd *cmd)
+{
+	struct skel_bot *bot = lun->bot;
+	unsigned int cdb_len, len = 0, residue = 0, tries;
+	bool write = false;
+	u8 cdb[16] = { };
+	int nents = 0;
+	int rv;
+
+	switch (req_op(rq)) {
+	case REQ_OP_WRITE:
+		write = true;
+		fallthrough;
+	case REQ_OP_READ:
+		len = blk_rq_bytes(rq);
+		cdb_len = skel_bot_rw_cdb(cdb, write,
+					  blk_rq_pos(rq) >> (lun->block_shift -
+							     SECTOR_SHIFT),
+					  len >> lun->block_shift);
+		nents = blk_rq_map_sg(rq->q, rq, cmd->sg);
+		break;
+	case REQ_OP_FLUSH:
+		cdb[0] = SYNCHRONIZE_CACHE;
+		cdb_len = 10;
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		write = true;
+		cdb_len = skel_bot_zero_cdb(lun, rq, cmd, cdb);
+		len = cmd->len;
+		nents = 1;
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+
+	/* a unit attention only tells us something changed, try again */
+	for (tries = 0; tries < SKEL_BOT_RETRIES; tries++) {
+		rv = skel_bot_command(bot, lun->lun, cdb, cdb_len, !write,
+				      cmd->sg, nents, len, &residue,
+				      skel_bot_rq_time(rq));
+		if (rv != UNIT_ATTENTION)
+			break;
+	}
+
+	return skel_bot_status(rq, rv, residue);
+}
+
+static void skel_bot_work(struct work_struct *work)
+{
+	struct skel_bot_cmd *cmd = container_of(work, struct skel_bot_cmd,
+						work);
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+	blk_mq_end_request(rq, skel_bot_execute(rq->q->queuedata, rq, cmd));
+}
+
+static blk_status_t skel_bot_queue_rq(struct blk_mq_hw_ctx *hctx,
+				      const struct blk_mq_queue_data *bd)
+{
+	struct skel_lun *lun = hctx->queue->queuedata;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
+
+	if (READ_ONCE(lun->bot->dead))
+		return BLK_STS_IOERR;
+
+	bd->rq->timeout = 2 * skel_bot_rq_time(bd->rq);
+	blk_mq_start_request(bd->rq);
+	queue_work(lun->bot->wq, &cmd->work);
+	return BLK_STS_OK;
+}
+
+/* the transport's own timer aborts the command, it then ends normally */
+static enum blk_eh_timer_return skel_bot_rq_timeout(struct request *rq)
+{
+	return BLK_EH_RESET_TIMER;
+}
+
+static int skel_bot_init_request(struct blk_mq_tag_set *set,
+				 struct request *rq, unsigned int hctx_idx,
+				 unsigned int numa_node)
+{
+	struct skel_bot *bot = set->driver_data;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	INIT_WORK(&cmd->work, skel_bot_work);
+	sg_init_table(cmd->sg, bot->segs);
+	return 0;
+}
+
+static const struct blk_mq_ops skel_bot_mq_ops = {
+	.queue_rq =	skel_bot_queue_rq,
+	.timeout =	skel_bot_rq_timeout,
+	.init_request =	skel_bot_init_request,
+};
+
+/*
+ * USB Attached SCSI
+ *
+ * SuperSpeed devices that offer it get UAS in place of BOT: a command
+ * pipe, a status pipe and a data pipe each way.  Every command has a
+ * tag, and its status and data go over the bulk stream of the same
+ * number, so the tag set can be as deep as the streams the host
+ * controller gave us.  Commands complete in whatever order the device
+ * chooses.  queue_rq() submits the status, data and command urbs
+ * directly, and the request completes when all of them are back.
+ */
+static void skel_uas_urb_done(struct urb *urb)
+{
+	struct request *rq = urb->context;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	int i;
+
+	if (urb->status) {
+		cmpxchg(&cmd->status, 0, urb->status);
+		/* the others may wait for something that won't come */
+		for (i = 0; i < SKEL_UAS_URBS; i++)
+			if (cmd->urbs[i] != urb)
+				usb_unlink_urb(cmd->urbs[i]);
+	}
+
+	if (atomic_dec_and_test(&cmd->pending))
+		blk_mq_complete_request(rq);
+}
+
+/* fill the urbs of a request, tag and stream are rq->tag + 1 */
+static blk_status_t skel_uas_prep(struct skel_lun *lun, struct request *rq,
+				  struct skel_bot_cmd *cmd)
+{
+	struct skel_bot *bot = lun->bot;
+	struct usb_device *udev = bot->dev->udev;
+	struct command_iu *iu = cmd->iu;
+	u16 tag = rq->tag + 1;
+	bool in = true;
+	struct urb *urb;
+	int nents = 0;
+
+	memset(iu, 0, sizeof(*iu));
+	cmd->len = blk_rq_bytes(rq);
+	switch (req_op(rq)) {
+	case REQ_OP_WRITE:
+		in = false;
+		fallthrough;
+	case REQ_OP_READ:
+		skel_bot_rw_cdb(iu->cdb, !in,
+				blk_rq_pos(rq) >> (lun->block_shift -
+						   SECTOR_SHIFT),
+				blk_rq_bytes(rq) >> lun->block_shift);
+		break;
+	case REQ_OP_FLUSH:
+		iu->cdb[0] = SYNCHRONIZE_CACHE;
+		cmd->len = 0;
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		in = false;
+		skel_bot_zero_cdb(lun, rq, cmd, iu->cdb);
+		nents = 1;
+		break;
+	case REQ_OP_DRV_IN:
+		memcpy(iu->cdb, cmd->cdb, sizeof(iu->cdb));
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+	if (!nents && cmd->len)
+		nents = blk_rq_map_sg(rq->q, rq, cmd->sg);
+
+	iu->iu_id = IU_ID_COMMAND;
+	iu->tag = cpu_to_be16(tag);
+	iu->prio_attr = UAS_SIMPLE_TAG;
+	/* single level LUN addressing */
+	iu->lun.scsi_lun[1] = lun->lun;
+
+	urb = cmd->urbs[SKEL_UAS_STATUS];
+	usb_fill_bulk_urb(urb, udev, bot->uas_pipe[STATUS_PIPE_ID],
+			  cmd->sense, sizeof(*cmd->sense), skel_uas_urb_done,
+			  rq);
+	urb->stream_id = tag;
+
+	urb = cmd->urbs[SKEL_UAS_DATA];
+	usb_fill_bulk_urb(urb, udev,
+			  bot->uas_pipe[in ? DATA_IN_PIPE_ID : DATA_OUT_PIPE_ID],
+			  NULL, cmd->len, skel_uas_urb_done, rq);
+	urb->sg = cmd->sg;
+	urb->num_sgs = nents;
+	urb->stream_id = tag;
+
+	urb = cmd->urbs[SKEL_UAS_CMD];
+	usb_fill_bulk_urb(urb, udev, bot->uas_pipe[CMD_PIPE_ID], iu,
+			  sizeof(*iu), skel_uas_urb_done, rq);
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t skel_uas_queue_rq(struct blk_mq_hw_ctx *hctx,
+				      const struct blk_mq_queue_data *bd)
+{
+	struct skel_lun *lun = hctx->queue->queuedata;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
+	struct request *rq = bd->rq;
+	struct skel_bot *bot = lun->bot;
+	blk_status_t sts;
+	int i, rv;
+
+	if (READ_ONCE(bot->dead))
+		return BLK_STS_IOERR;
+
+	/* a fresh request, not one we requeued */
+	if (!(rq->rq_flags & RQF_DONTPREP)) {
+		cmd->retries = 0;
+		rq->rq_flags |= RQF_DONTPREP;
+	}
+
+	sts = skel_uas_prep(lun, rq, cmd);
+	if (sts)
+		return sts;
+
+	cmd->status = 0;
+	/* one extra, so nothing completes before all are submitted */
+	atomic_set(&cmd->pending, SKEL_UAS_URBS + 1);
+	rq->timeout = 2 * skel_bot_rq_time(rq);
+	blk_mq_start_request(rq);
+
+	/* the device may only answer into streams it has been given */
+	for (i = 0; i < SKEL_UAS_URBS; i++) {
+		if (i == SKEL_UAS_DATA && !cmd->len) {
+			atomic_dec(&cmd->pending);
+			continue;
+		}
+		usb_anchor_urb(cmd->urbs[i], &bot->uas_submitted);
+		rv = usb_submit_urb(cmd->urbs[i], GFP_ATOMIC);
+		if (rv) {
+			usb_unanchor_urb(cmd->urbs[i]);
+			dev_err(&bot->dev->udev->dev,
+				"%s - failed submitting urb, error %d\n",
+				__func__, rv);
+			cmpxchg(&cmd->status, 0, rv);
+			/* the rest isn't sent, what was sent is called back */
+			atomic_sub(SKEL_UAS_URBS - i, &cmd->pending);
+			for (i--; i >= 0; i--)
+				usb_unlink_urb(cmd->urbs[i]);
+			break;
+		}
+	}
+
+	if (atomic_dec_and_test(&cmd->pending))
+		blk_mq_complete_request(rq);
+	return BLK_STS_OK;
+}
+
+static void skel_uas_complete(struct request *rq)
+{
+	struct skel_lun *lun = rq->q->queuedata;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct sense_iu *sense = cmd->sense;
+	unsigned int residue = 0;
+	bool retry = false;
+	int rv = 0;
+
+	if (cmd->status) {
+		/* unlinked after a timeout, or lost in a reset */
+		rv = -EIO;
+		retry = true;
+	} else if (sense->iu_id != IU_ID_STATUS) {
+		rv = -EIO;
+	} else if (sense->status == SAM_STAT_CHECK_CONDITION) {
+		rv = skel_sense_key(sense->sense) ?: -EIO;
+		retry = rv == UNIT_ATTENTION;
+	} else if (sense->status != SAM_STAT_GOOD) {
+		/* busy or task set full */
+		rv = -EIO;
+		retry = true;
+	} else if (cmd->len) {
+		residue = cmd->len - cmd->urbs[SKEL_UAS_DATA]->actual_length;
+	}
+
+	/* lost in a reset isn't the command's fault, that isn't a retry */
+	if (retry && (READ_ONCE(lun->bot->stopped) ||
+		      cmd->retries++ < SKEL_BOT_RETRIES)) {
+		blk_mq_requeue_request(rq, true);
+		return;
+	}
+
+	if (req_op(rq) == REQ_OP_DRV_IN) {
+		cmd->result = rv;
+		blk_mq_end_request(rq, BLK_STS_OK);
+		return;
+	}
+	blk_mq_end_request(rq, skel_bot_status(rq, rv, residue));
+}
+
+/*
+ * Unlinking gives the request back, but the device may still think
+ * the command is running, so reset it.  Requests lost that way are
+ * sent again.
+ */
+static enum blk_eh_timer_return skel_uas_rq_timeout(struct request *rq)
+{
+	struct skel_lun *lun = rq->q->queuedata;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	int i;
+
+	for (i = 0; i < SKEL_UAS_URBS; i++)
+		usb_unlink_urb(cmd->urbs[i]);
+	schedule_work(&lun->bot->reset_work);
+	return BLK_EH_RESET_TIMER;
+}
+
+static void skel_uas_reset_work(struct work_struct *work)
+{
+	struct skel_bot *bot = container_of(work, struct skel_bot, reset_work);
+	struct usb_skel *dev = bot->dev;
+
+	if (usb_lock_device_for_reset(dev->udev, dev->interface))
+		return;
+	usb_reset_device(dev->udev);
+	usb_unlock_device(dev->udev);
+}
+
+static int skel_uas_init_request(struct blk_mq_tag_set *set,
+				 struct request *rq, unsigned int hctx_idx,
+				 unsigned int numa_node)
+{
+	struct skel_bot *bot = set->driver_data;
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	int i;
+
+	sg_init_table(cmd->sg, bot->segs);
+	/* not in the pdu, the device DMAs into them */
+	cmd->iu = kzalloc(sizeof(*cmd->iu), GFP_KERNEL);
+	cmd->sense = kzalloc(sizeof(*cmd->sense), GFP_KERNEL);
+	if (!cmd->iu || !cmd->sense)
+		return -ENOMEM;
+	for (i = 0; i < SKEL_UAS_URBS; i++) {
+		cmd->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!cmd->urbs[i])
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void skel_uas_exit_request(struct blk_mq_tag_set *set,
+				  struct request *rq, unsigned int hctx_idx)
+{
+	struct skel_bot_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	int i;
+
+	for (i = 0; i < SKEL_UAS_URBS; i++)
+		usb_free_urb(cmd->urbs[i]);
+	kfree(cmd->iu);
+	kfree(cmd->sense);
+}
+
+static const struct blk_mq_ops skel_uas_mq_ops = {
+	.queue_rq =	skel_uas_queue_rq,
+	.complete =	skel_uas_complete,
+	.timeout =	skel_uas_rq_timeout,
+	.init_request =	skel_uas_init_request,
+	.exit_request =	skel_uas_exit_request,
+};
+
+/* one of our own commands, through the queue like any other */
+static int skel_uas_simple(struct skel_lun *lun, const u8 *cdb,
+			   unsigned int cdb_len, unsigned int len)
+{
+	struct request_queue *q = lun->disk->queue;
+	struct skel_bot_cmd *cmd;
+	struct request *rq;
+	int rv;
+
+	rq = blk_mq_alloc_request(q, REQ_OP_DRV_IN, 0);
+	if (IS_ERR(rq))
+		return PTR_ERR(rq);
+	cmd = blk_mq_rq_to_pdu(rq);
+	memset(cmd->cdb, 0, sizeof(cmd->cdb));
+	memcpy(cmd->cdb, cdb, cdb_len);
+
+	if (len) {
+		rv = blk_rq_map_kern(q, rq, lun->bot->buf, len, GFP_KERNEL);
+		if (rv)
+			goto out;
+	}
+
+	rv = blk_execute_rq(rq, false) ? -EIO : cmd->result;
+out:
+	blk_mq_free_request(rq);
+	return rv;
+}
+
+/* the pipe an endpoint plays, from its pipe usage descriptor */
+static int skel_uas_pipe_id(struct usb_host_endpoint *ep)
+{
+	unsigned char *extra = ep->extra;
+	int len = ep->extralen;
+
+	while (len >= 3) {
+		if (extra[0] < 2 || extra[0] > len)
+			break;
+		if (extra[1] == USB_DT_PIPE_USAGE)
+			return extra[2];
+		len -= extra[0];
+		extra += extra[0];
+	}
+	return 0;
+}
+
+/*
+ * Switch to the UAS alternate setting and set up its streams.  Returns
+ * 0 if the device now speaks UAS, otherwise it stays at BOT.
+ */
+static int skel_uas_probe(struct skel_bot *bot)
+{
+	struct usb_skel *dev = bot->dev;
+	struct usb_interface *interface = dev->interface;
+	struct usb_host_endpoint *eps[DATA_OUT_PIPE_ID + 1] = { };
+	struct usb_host_interface *alt = NULL;
+	unsigned int i, streams = SKEL_UAS_STREAMS;
+	int id, rv;
+
+	/* streams need SuperSpeed, and the data goes out as one sg urb */
+	if (dev->udev->speed < USB_SPEED_SUPER || !dev->udev->bus->sg_tablesize)
+		return -ENODEV;
+
+	for (i = 0; i < interface->num_altsetting; i++) {
+		if (interface->altsetting[i].desc.bInterfaceProtocol ==
+		    USB_PR_UAS) {
+			alt = &interface->altsetting[i];
+			break;
+		}
+	}
+	if (!alt)
+		return -ENODEV;
+
+	for (i = 0; i < alt->desc.bNumEndpoints; i++) {
+		id = skel_uas_pipe_id(&alt->endpoint[i]);
+		if (id >= CMD_PIPE_ID && id <= DATA_OUT_PIPE_ID)
+			eps[id] = &alt->endpoint[i];
+	}
+	for (id = CMD_PIPE_ID; id <= DATA_OUT_PIPE_ID; id++) {
+		if (!eps[id])
+			return -ENODEV;
+		if (id != CMD_PIPE_ID)
+			streams = min_t(unsigned int, streams,
+					usb_ss_max_streams(&eps[id]->ss_ep_comp));
+	}
+	if (!streams)
+		return -ENODEV;
+
+	rv = usb_set_interface(dev->udev, bot->ifnum,
+			       alt->desc.bAlternateSetting);
+	if (rv)
+		return rv;
+
+	/* status and data in stream, commands don't */
+	bot->uas_eps[0] = eps[STATUS_PIPE_ID];
+	bot->uas_eps[1] = eps[DATA_IN_PIPE_ID];
+	bot->uas_eps[2] = eps[DATA_OUT_PIPE_ID];
+	rv = usb_alloc_streams(interface, bot->uas_eps, 3, streams,
+			       GFP_KERNEL);
+	if (rv <= 0) {
+		usb_set_interface(dev->udev, bot->ifnum, 0);
+		return rv ? rv : -ENODEV;
+	}
+	bot->streams = rv;
+
+	for (id = CMD_PIPE_ID; id <= DATA_OUT_PIPE_ID; id++) {
+		i = usb_endpoint_num(&eps[id]->desc);
+		bot->uas_pipe[id] = usb_endpoint_dir_in(&eps[id]->desc) ?
+				    usb_rcvbulkpipe(dev->udev, i) :
+				    usb_sndbulkpipe(dev->udev, i);
+	}
+	bot->uas = true;
+
+	return 0;
+}
+
+/* the last reference to the disk is gone, so is its hold on us */
+static void skel_bot_free_disk(struct gendisk *disk)
+{
+	struct skel_lun *lun = disk->private_data;
+
+	kref_put(&lun->bot->dev->kref, skel_delete);
+}
+
+static int skel_bot_capacity(struct skel_bot *bot, struct skel_lun *lun);
+static void skel_bot_limits(struct skel_lun *lun);
+static void skel_bot_queue_limits(struct skel_lun *lun);
+
+/*
+ * Polled for units whose medium may come and go.  A unit attention
+ * says the medium was changed, a unit that turns ready or not ready
+ * says it came or went.  The disk then gets the new size, and the
+ * limits of the new medium, set with the queue frozen.  The commands
+ * are sent before that, UAS sends them through the queue.
+ */
+static unsigned int skel_bot_check_events(struct gendisk *disk,
+					  unsigned int clearing)
+{
+	struct skel_lun *lun = disk->private_data;
+	struct skel_bot *bot = lun->bot;
+	u8 tur[6] = { TEST_UNIT_READY };
+	bool changed = false;
+	int rv;
+
+	mutex_lock(&bot->buf_mutex);
+	rv = skel_bot_simple(lun, tur, sizeof(tur), 0);
+	if (rv == UNIT_ATTENTION) {
+		changed = true;
+		rv = skel_bot_simple(lun, tur, sizeof(tur), 0);
+	}
+	/* the transport is busy or gone, no news */
+	if (rv < 0) {
+		mutex_unlock(&bot->buf_mutex);
+		return 0;
+	}
+
+	if (!rv != lun->ready)
+		changed = true;
+	if (changed) {
+		lun->ready = !rv && !skel_bot_capacity(bot, lun);
+		if (!lun->ready)
+			lun->blocks = 0;
+		else if (lun->vpd)
+			skel_bot_limits(lun);
+
+		blk_mq_freeze_queue(disk->queue);
+		skel_bot_queue_limits(lun);
+		blk_mq_unfreeze_queue(disk->queue);
+		set_capacity_and_notify(disk, lun->blocks <<
+					(lun->block_shift - SECTOR_SHIFT));
+	}
+	mutex_unlock(&bot->buf_mutex);
+
+	return changed ? DISK_EVENT_MEDIA_CHANGE : 0;
+}
+
+/* a changed medium gets its partitions scanned again */
+static int skel_bot_open(struct gendisk *disk, blk_mode_t mode)
+{
+	disk_check_media_change(disk);
+	return 0;
+}
+
+static const struct block_device_operations skel_bot_fops = {
+	.owner =	THIS_MODULE,
+	.open =		skel_bot_open,
+	.check_events =	skel_bot_check_events,
+	.free_disk =	skel_bot_free_disk,
+};
+
+/* one VPD page into bot->buf, fields the unit doesn't fill stay zero */
+static int skel_bot_vpd(struct skel_lun *lun, u8 page)
+{
+	u8 vpd[6] = { INQUIRY, 1, page, 0, SKEL_BOT_BUF, 0 };
+	u8 *buf = lun->bot->buf;
+	int rv;
+
+	memset(buf, 0, SKEL_BOT_BUF);
+	rv = skel_bot_simple(lun, vpd, sizeof(vpd), SKEL_BOT_BUF);
+	if (rv)
+		return rv;
+	return buf[1] == page ? 0 : -EIO;
+}
+
+/*
+ * Transfer limits from the Block Limits VPD page, and how to discard
+ * from the Logical Block Provisioning one.  Only pages listed on the
+ * Supported VPD Pages page are asked for, some USB devices fall over
+ * when asked for a page they don't have.  What a previous medium
+ * reported is forgotten first.
+ */
+static void skel_bot_limits(struct skel_lun *lun)
+{
+	bool limits = false, lbp = false;
+	u8 *buf = lun->bot->buf;
+	u32 max_descs = 0;
+	int i, n;
+
+	lun->max_xfer = 0;
+	lun->opt_xfer = 0;
+	lun->opt_gran = 0;
+	lun->max_unmap = 0;
+	lun->unmap_gran = 0;
+	lun->max_ws = 0;
+	lun->discard = 0;
+	lun->write_same = false;
+	lun->ws10 = false;
+
+	if (skel_bot_vpd(lun, 0))
+		return;
+	n = min_t(int, buf[3], SKEL_BOT_BUF - 4);
+	for (i = 0; i < n; i++) {
+		if (buf[4 + i] == 0xb0)
+			limits = true;
+		else if (buf[4 + i] == 0xb2)
+			lbp = true;
+	}
+
+	if (limits && !skel_bot_vpd(lun, 0xb0)) {
+		lun->opt_gran = get_unaligned_be16(&buf[6]);
+		lun->max_xfer = get_unaligned_be32(&buf[8]);
+		lun->opt_xfer = get_unaligned_be32(&buf[12]);
+		lun->max_unmap = get_unaligned_be32(&buf[20]);
+		max_descs = get_unaligned_be32(&buf[24]);
+		lun->unmap_gran = get_unaligned_be32(&buf[28]);
+		lun->max_ws = get_unaligned_be64(&buf[36]);
+	}
+
+	/* LBPU, LBPWS and LBPWS10 in byte 5 */
+	if (!lbp || skel_bot_vpd(lun, 0xb2))
+		return;
+	/*
+	 * a maximum unmap LBA or block descriptor count of zero means no
+	 * UNMAP after all, we send one descriptor
+	 */
+	if ((buf[5] & 0x80) && lun->max_unmap && max_descs)
+		lun->discard = SKEL_DISCARD_UNMAP;
+	else if (buf[5] & 0x60)
+		lun->discard = SKEL_DISCARD_WS;
+	lun->ws10 = !(buf[5] & 0x40) && (buf[5] & 0x20);
+	lun->write_same = (buf[5] & 0x60) || lun->max_ws;
+}
+
+/* size of the medium in the unit, called with buf_mutex held */
+static int skel_bot_capacity(struct skel_bot *bot, struct skel_lun *lun)
+{
+	u8 cap10[10] = { READ_CAPACITY };
+	u8 cap16[16] = { SERVICE_ACTION_IN_16, SAI_READ_CAPACITY_16 };
+	u8 *buf = bot->buf;
+	u32 block_len;
+	u64 last;
+	int rv;
+
+	rv = skel_bot_simple(lun, cap10, sizeof(cap10), 8);
+	if (rv)
+		return rv < 0 ? rv : -EIO;
+	last = get_unaligned_be32(&buf[0]);
+	block_len = get_unaligned_be32(&buf[4]);
+
+	/* too large for READ CAPACITY(10) */
+	if (last == U32_MAX) {
+		put_unaligned_be32(32, &cap16[10]);
+		rv = skel_bot_simple(lun, cap16, sizeof(cap16), 32);
+		if (rv)
+			return rv < 0 ? rv : -EIO;
+		last = get_unaligned_be64(&buf[0]);
+		block_len = get_unaligned_be32(&buf[8]);
+	}
+
+	if (block_len < SECTOR_SIZE || block_len > PAGE_SIZE ||
+	    !is_power_of_2(block_len)) {
+		dev_err(&bot->dev->interface->dev,
+			"%s - unsupported block size %u\n", __func__,
+			block_len);
+		return -ENODEV;
+	}
+	lun->block_shift = ilog2(block_len);
+	lun->blocks = last + 1;
+
+	return 0;
+}
+
+/*
+ * Find out whether the unit is a disk we can serve, and its size.  A
+ * unit without a medium is served too, empty until check_events()
+ * finds one.  Called with buf_mutex held.
+ */
+static int skel_bot_scan(struct skel_bot *bot, struct skel_lun *lun)
+{
+	u8 inquiry[6] = { INQUIRY, 0, 0, 0, 36, 0 };
+	u8 tur[6] = { TEST_UNIT_READY };
+	u8 *buf = bot->buf;
+	u8 version;
+	int rv, i;
+
+	memset(buf, 0, SKEL_BOT_BUF);
+	rv = skel_bot_simple(lun, inquiry, sizeof(inquiry), 36);
+	if (rv)
+		return rv < 0 ? rv : -EIO;
+	version = buf[2];
+	if (buf[0] >> 5) {
+		/* nothing connected at this unit */
+		return -ENODEV;
+	}
+	switch (buf[0] & 0x1f) {
+	case TYPE_DISK:
+	case TYPE_RBC:
+	case TYPE_MOD:
+		break;
+	case TYPE_ROM:
+		lun->read_only = true;
+		break;
+	default:
+		return -ENODEV;
+	}
+	lun->removable = buf[1] & 0x80;
+	dev_info(&bot->dev->interface->dev, "LUN %u: %.8s %.16s %.4s\n",
+		 lun->lun, &buf[8], &buf[16], &buf[32]);
+
+	/* give a unit that is still spinning up some time */
+	for (i = 0; i < SKEL_BOT_RETRIES * 4; i++) {
+		rv = skel_bot_simple(lun, tur, sizeof(tur), 0);
+		if (rv != UNIT_ATTENTION && rv != NOT_READY)
+			break;
+		if (rv == NOT_READY)
+			msleep(500);
+	}
+	if (rv == NOT_READY) {
+		/* no medium, the disk stays empty for now */
+		lun->block_shift = SECTOR_SHIFT;
+		lun->blocks = 0;
+	} else if (rv) {
+		return rv < 0 ? rv : -EIO;
+	} else {
+		rv = skel_bot_capacity(bot, lun);
+		if (rv)
+			return rv;
+		lun->ready = true;
+	}
+
+	/* VPD pages came with SPC-3 */
+	lun->vpd = version >= 5;
+	if (lun->vpd)
+		skel_bot_limits(lun);
+
+	return 0;
+}
+
+/* the disk of a unit, before the scan: UAS sends the scan through its queue */
+static int skel_bot_alloc_disk(struct skel_bot *bot, struct skel_lun *lun)
+{
+	struct usb_skel *dev = bot->dev;
+	struct request_queue *q;
+	struct gendisk *disk;
+
+	disk = blk_mq_alloc_disk(&lun->tag_set, lun);
+	if (IS_ERR(disk))
+		return PTR_ERR(disk);
+	q = disk->queue;
+
+	blk_queue_max_segments(q, bot->segs);
+	/* USB can't DMA to arbitrary addresses */
+	blk_queue_update_dma_alignment(q, SECTOR_SIZE - 1);
+	/*
+	 * Without arbitrary sg support every segment but the last has to
+	 * end on a packet, or a short packet ends the transfer early.
+	 */
+	if (!dev->udev->bus->no_sg_constraint)
+		blk_queue_virt_boundary(q, max(dev->bulk_in_maxp,
+					       dev->bulk_out_maxp) - 1);
+	blk_queue_write_cache(q, true, false);
+	blk_queue_rq_timeout(q, 2 * SKEL_BOT_TIMEOUT);
+
+	disk->fops = &skel_bot_fops;
+	disk->private_data = lun;
+	snprintf(disk->disk_name, DISK_NAME_LEN, "skelb%d", lun->index);
+	lun->disk = disk;
+
+	return 0;
+}
+
+/* largest discard and write zeroes, in sectors of the queue */
+static unsigned int skel_bot_sectors(struct skel_lun *lun, u64 blocks)
+{
+	return min_t(u64, blocks << (lun->block_shift - SECTOR_SHIFT),
+		     UINT_MAX >> SECTOR_SHIFT);
+}
+
+static void skel_bot_discard_limits(struct skel_lun *lun,
+				    struct request_queue *q)
+{
+	u64 ws = lun->ws10 ? SKEL_WS10_BLOCKS : SKEL_WS16_BLOCKS;
+
+	if (lun->max_ws)
+		ws = min(ws, lun->max_ws);
+
+	/* a medium that no longer has them takes them away */
+	blk_queue_max_discard_sectors(q, 0);
+	blk_queue_max_write_zeroes_sectors(q, 0);
+
+	if (lun->discard) {
+		blk_queue_max_discard_sectors(q, skel_bot_sectors(lun,
+				lun->discard == SKEL_DISCARD_UNMAP ?
+				lun->max_unmap : ws));
+		q->limits.discard_granularity = 1 << lun->block_shift;
+		if (lun->unmap_gran &&
+		    lun->unmap_gran <= UINT_MAX >> lun->block_shift)
+			q->limits.discard_granularity =
+				lun->unmap_gran << lun->block_shift;
+	}
+	if (lun->write_same)
+		blk_queue_max_write_zeroes_sectors(q,
+						   skel_bot_sectors(lun, ws));
+}
+
+/*
+ * The limits of the unit and its medium, when the disk is added and
+ * with the queue frozen when the medium changes.
+ */
+static void skel_bot_queue_limits(struct skel_lun *lun)
+{
+	struct usb_skel *dev = lun->bot->dev;
+	struct request_queue *q = lun->disk->queue;
+	unsigned int shift = lun->block_shift;
+	unsigned int max_sectors;
+	u64 opt;
+
+	/* the unit's own limit, so requests merge up to what it takes */
+	max_sectors = bot_max_sectors;
+	if (lun->max_xfer)
+		max_sectors = min_t(u64, (u64)lun->max_xfer <<
+					 (shift - SECTOR_SHIFT), UINT_MAX);
+	max_sectors = max_t(unsigned int, max_sectors,
+			    PAGE_SIZE >> SECTOR_SHIFT);
+	max_sectors = min_t(size_t, max_sectors,
+			    dma_max_mapping_size(dev->udev->bus->sysdev) >>
+			    SECTOR_SHIFT);
+	blk_queue_max_hw_sectors(q, max_sectors);
+	blk_queue_logical_block_size(q, 1 << shift);
+	blk_queue_physical_block_size(q, 1 << shift);
+
+	blk_queue_io_min(q, lun->opt_gran << shift);
+	/* ignore an optimum the unit couldn't be sent in one go */
+	opt = (u64)lun->opt_xfer << shift;
+	if (opt < PAGE_SIZE || opt > (u64)max_sectors << SECTOR_SHIFT)
+		opt = 0;
+	blk_queue_io_opt(q, opt);
+
+	if (!lun->read_only)
+		skel_bot_discard_limits(lun, q);
 }
 
-static int skel_do_read_io(struct usb_skel *dev, size_t count)
+/* the scan found the unit usable, show it to the world */
+static int skel_bot_add_disk(struct skel_bot *bot, struct skel_lun *lun)
 {
+	struct usb_skel *dev = bot->dev;
+	struct gendisk *disk = lun->disk;
 	int rv;
 
-	/* prepare a read */
-	usb_fill_bulk_urb(dev->bulk_in_urb,
-			dev->udev,
-			usb_rcvbulkpipe(dev->udev,
-				dev->bulk_in_endpointAddr),
-			dev->bulk_in_buffer,
-			min(dev->bulk_in_size, count),
-			skel_read_bulk_callback,
-			dev);
-	/* tell everybody to leave the URB alone */
-	spin_lock_irq(&dev->err_lock);
-	dev->ongoing_read = 1;
-	spin_unlock_irq(&dev->err_lock);
+	skel_bot_queue_limits(lun);
+	set_capacity(disk, lun->blocks << (lun->block_shift - SECTOR_SHIFT));
+	set_disk_ro(disk, lun->read_only);
 
-	/* do it */
-	rv = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
-	if (rv < 0) {
-		err("%s - failed submitting read urb, error %d",
-			__func__, rv);
-		dev->bulk_in_filled = 0;
-		rv = (rv == -ENOMEM) ? rv : -EIO;
-		spin_lock_irq(&dev->err_lock);
-		dev->ongoing_read = 0;
-		spin_unlock_irq(&dev->err_lock);
+	/* a medium that may come and go is looked for, like sd does */
+	if (lun->removable || !lun->ready) {
+		disk->events = DISK_EVENT_MEDIA_CHANGE;
+		disk->event_flags = DISK_EVENT_FLAG_POLL | DISK_EVENT_FLAG_UEVENT;
 	}
 
-	return rv;
+	/* the disk holds on to us until skel_bot_free_disk() */
+	kref_get(&dev->kref);
+	rv = device_add_disk(&dev->interface->dev, disk, NULL);
+	if (rv) {
+		/* free_disk is only called for disks that were added */
+		kref_put(&dev->kref, skel_delete);
+		return rv;
+	}
+
+	return 0;
 }
 
-static ssize_t skel_read(struct file *file, char *buffer, size_t count,
-			 loff_t *ppos)
+static void skel_bot_free(struct skel_bot *bot)
 {
-	struct usb_skel *dev;
-	int rv;
-	bool ongoing_io;
-
-	printk(KERN_INFO "==eric_Read==\n");
-	//取出從open那邊 attach 上來的 usb_skel
-	dev = file->private_data;
-
-	//檢查 urb 與 count 是否有配置，urb就是在probe那邊配置的一塊記憶體
-	/* if we cannot read at all, return EOF */
+	unsigned int i;
+
+	for (i = 0; i < bot->nr_luns; i++)
+		if (bot->luns[i].index >= 0)
+			ida_free(&skel_bot_ida, bot->luns[i].index);
+	kfree(bot->luns);
+	usb_free_urb(bot->urb);
+	kfree(bot->iobuf);
+	kfree(bot->buf);
+	kfree(bot->sense);
+	kfree(bot);
+}
 
-	printk(KERN_INFO "dev->bulk_in_urb=%d, count=%d\n", dev->bulk_in_urb, count);
+/* highest LUN of a Bulk-Only device, those with only one may stall */
+static unsigned int skel_bot_max_lun(struct skel_bot *bot)
+{
+	struct usb_skel *dev = bot->dev;
+	u8 max_lun;
+	int rv;
 
-	if (!dev->bulk_in_urb || !count)
+	rv = usb_control_msg_recv(dev->udev, 0, US_BULK_GET_MAX_LUN,
+				  USB_DIR_IN | USB_TYPE_CLASS |
+				  USB_RECIP_INTERFACE, 0, bot->ifnum,
+				  &max_lun, 1, USB_CTRL_GET_TIMEOUT,
+				  GFP_KERNEL);
+	/* the CBW has four bits for it */
+	if (rv || max_lun > 15)
 		return 0;
+	return max_lun;
+}
 
-	/* no concurrent readers */
-	rv = mutex_lock_interruptible(&dev->io_mutex);
-	if (rv < 0)
-		return rv;
+/*
+ * Queue, disk and scan of one unit.  Every unit gets a tag set of its
+ * own, for BOT of depth one: the ordered workqueue then holds at most
+ * one command per unit and runs them in turn, so a busy unit can't
+ * starve the others of the shared transport.
+ */
+static int skel_bot_lun_probe(struct skel_bot *bot, struct skel_lun *lun)
+{
+	struct blk_mq_tag_set *set = &lun->tag_set;
+	int rv;
 
-	//檢查interface是否有值
-	if (!dev->interface) {		/* disconnect() was called */
-		rv = -ENODEV;
-		goto exit;
-	}
+	lun->index = ida_alloc(&skel_bot_ida, GFP_KERNEL);
+	if (lun->index < 0)
+		return lun->index;
+
+	set->ops = bot->uas ? &skel_uas_mq_ops : &skel_bot_mq_ops;
+	set->nr_hw_queues = 1;
+	set->queue_depth = bot->uas ? bot->streams : 1;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct skel_bot_cmd) +
+			bot->segs * sizeof(struct scatterlist);
+	set->flags = BLK_MQ_F_SHOULD_MERGE;
+	set->driver_data = bot;
+	rv = blk_mq_alloc_tag_set(set);
+	if (rv)
+		return rv;
 
-	printk(KERN_ERR "read_start\n");
+	rv = skel_bot_alloc_disk(bot, lun);
+	if (rv)
+		goto error_tag_set;
 
-	//這邊作一個goto tag, 目的就是要retry
-	/* if IO is under way, we must not touch things */
-retry:
-	spin_lock_irq(&dev->err_lock);
-	ongoing_io = dev->ongoing_read; //這個是一個bool
-	spin_unlock_irq(&dev->err_lock);
+	mutex_lock(&bot->buf_mutex);
+	rv = skel_bot_scan(bot, lun);
+	mutex_unlock(&bot->buf_mutex);
+	if (rv)
+		goto error_disk;
 
-	printk(KERN_ERR "ongoing_io=%d\n", ongoing_io);
-	if (ongoing_io) {
+	rv = skel_bot_add_disk(bot, lun);
+	if (rv)
+		goto error_disk;
+	return 0;
 
-		printk(KERN_ERR "file->f_flags=%d\n", file->f_flags);
+error_disk:
+	/* a timed out scan command may have asked for a reset */
+	cancel_work_sync(&bot->reset_work);
+	put_disk(lun->disk);
+	lun->disk = NULL;
+error_tag_set:
+	blk_mq_free_tag_set(set);
+	return rv;
+}
 
-		/* nonblocking IO shall not wait */
-		if (file->f_flags & O_NONBLOCK) {
-			rv = -EAGAIN;
-			goto exit;
-		}
-		/*
-		 * IO may take forever
-		 * hence wait in an interruptible state
-		 */
-		
-		rv = wait_for_completion_interruptible(&dev->bulk_in_completion);
+/* called by probe for a mass-storage interface instead of usb_register_dev() */
+static int skel_bot_probe(struct usb_skel *dev)
+{
+	struct usb_interface *interface = dev->interface;
+	unsigned int i, found = 0;
+	struct skel_lun *lun;
+	struct skel_bot *bot;
+	int rv;
 
-		printk(KERN_ERR "rv=%d\n", rv);
-		if (rv < 0)
-			goto exit;
-		/*
-		 * by waiting we also semiprocessed the urb
-		 * we must finish now
-		 */
-		dev->bulk_in_copied = 0;
-		dev->processed_urb = 1;
+	bot = kzalloc(sizeof(*bot), GFP_KERNEL);
+	if (!bot)
+		return -ENOMEM;
+	bot->dev = dev;
+	bot->ifnum = interface->cur_altsetting->desc.bInterfaceNumber;
+	mutex_init(&bot->mutex);
+	mutex_init(&bot->buf_mutex);
+	spin_lock_init(&bot->lock);
+	init_completion(&bot->done);
+	timer_setup(&bot->timer, skel_bot_timeout, 0);
+	init_usb_anchor(&bot->uas_submitted);
+	INIT_WORK(&bot->reset_work, skel_uas_reset_work);
+	/* skel_delete() frees it from here on */
+	dev->bot = bot;
+
+	bot->urb = usb_alloc_urb(0, GFP_KERNEL);
+	bot->iobuf = kmalloc(SKEL_BOT_BUF, GFP_KERNEL);
+	bot->buf = kmalloc(SKEL_BOT_BUF, GFP_KERNEL);
+	bot->sense = kmalloc(SKEL_BOT_SENSE_LEN, GFP_KERNEL);
+	if (!bot->urb || !bot->iobuf || !bot->buf || !bot->sense)
+		return -ENOMEM;
+
+	/* a device that can't fall back to BOT must get its streams */
+	rv = skel_uas_probe(bot);
+	if (rv && interface->cur_altsetting->desc.bInterfaceProtocol ==
+		  USB_PR_UAS) {
+		dev_err(&interface->dev,
+			"%s - no streams for a UAS only device, error %d\n",
+			__func__, rv);
+		return -ENODEV;
 	}
 
-	printk(KERN_ERR "dev->processed_urb=%d\n", dev->processed_urb);
-	//等於0時，說明這個URB還沒被處理過，即第一次讀取這個URB
-	if (!dev->processed_urb) {
-		/*
-		 * the URB hasn't been processed
-		 * do it now
-		 */
-		//completion 是任務使用的一個輕量級機制: 允許一個線程告訴另一個線程工作已經完成
-		// 詳細請看 http://blog.roodo.com/_jacob_/archives/2884879.html
-
-		printk(KERN_ERR "wfc_start=%d\n", &dev->bulk_in_completion.done);
-		wait_for_completion(&dev->bulk_in_completion);
-		printk(KERN_ERR "wfc_end=%d\n", &dev->bulk_in_completion.done);
-
-		dev->bulk_in_copied = 0;
-		dev->processed_urb = 1;
+	/* UAS has REPORT LUNS for this, we only look at LUN 0 there */
+	bot->nr_luns = bot->uas ? 1 : skel_bot_max_lun(bot) + 1;
+	bot->luns = kcalloc(bot->nr_luns, sizeof(*bot->luns), GFP_KERNEL);
+	if (!bot->luns) {
+		bot->nr_luns = 0;
+		rv = -ENOMEM;
+		goto error_streams;
 	}
-
-	/* errors must be reported */
-	rv = dev->errors;
-	if (rv < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		rv = (rv == -EPIPE) ? rv : -EIO;
-		/* no data to deliver */
-		dev->bulk_in_filled = 0;
-		/* report it */
-		goto exit;
+	for (i = 0; i < bot->nr_luns; i++) {
+		bot->luns[i].bot = bot;
+		bot->luns[i].lun = i;
+		bot->luns[i].index = -1;
 	}
 
-	/*
-	 * if the buffer is filled we may satisfy the read
-	 * else we need to start IO
-	 */
-	printk(KERN_ERR "dev->bulk_in_filled=%d\n", dev->bulk_in_filled);
-	if (dev->bulk_in_filled) {
-		/* we had read data */
-		size_t available = dev->bulk_in_filled - dev->bulk_in_copied;
-		size_t chunk = min(available, count);
-
-		printk(KERN_ERR "dev->bulk_in_copied=%d, dev->bulk_in_filled=%d\n", dev->bulk_in_copied, dev->bulk_in_filled);
-		printk(KERN_ERR "available=%d, chunk=%d\n", available, chunk);
-		
-		if (!available) {
-			/*
-			 * all data has been used
-			 * actual IO needs to be done
-			 */
-			rv = skel_do_read_io(dev, count);
-			if (rv < 0)
-				goto exit;
-			else
-				goto retry;
+	/* no sg support means one urb per segment, keep them few */
+	bot->segs = min_t(unsigned int,
+			  dev->udev->bus->sg_tablesize ?: SKEL_BOT_SEGS,
+			  SKEL_BOT_SEGS);
+
+	/* writeback may depend on it, so it must make progress under pressure */
+	if (!bot->uas) {
+		bot->wq = alloc_ordered_workqueue("skel_bot-%s", WQ_MEM_RECLAIM,
+						  dev_name(&interface->dev));
+		if (!bot->wq) {
+			rv = -ENOMEM;
+			goto error_streams;
 		}
-		/*
-		 * data is available
-		 * chunk tells us how much shall be copied
-		 */
+	}
 
-		if (copy_to_user(buffer,
-				 dev->bulk_in_buffer + dev->bulk_in_copied,
-				 chunk))
-			rv = -EFAULT;
-		else
-			rv = chunk;
+	/* a card reader's empty slots don't keep the others from working */
+	rv = -ENODEV;
+	for (i = 0; i < bot->nr_luns; i++) {
+		lun = &bot->luns[i];
+		rv = skel_bot_lun_probe(bot, lun);
+		if (rv) {
+			dev_info(&interface->dev, "LUN %u not usable, error %d\n",
+				 i, rv);
+			continue;
+		}
+		if (!found++)
+			dev->minor = lun->index;
+		dev_info(&interface->dev, "USB mass storage LUN %u now attached to %s (%s)",
+			 i, lun->disk->disk_name, bot->uas ? "UAS" : "BOT");
+	}
+	if (!found) {
+		dev_err(&interface->dev, "%s - no usable unit, error %d\n",
+			__func__, rv);
+		goto error_wq;
+	}
 
-		dev->bulk_in_copied += chunk;
+	usb_set_intfdata(interface, dev);
+	/* I/O may come at any time, don't let the device autosuspend */
+	usb_autopm_get_interface_no_resume(interface);
+	return 0;
 
-		/*
-		 * if we are asked for more than we have,
-		 * we start IO but don't wait
-		 */
-		if (available < count)
-			skel_do_read_io(dev, count - chunk);
-	} else {
-		/* no data in the buffer */
-		rv = skel_do_read_io(dev, count);
-		if (rv < 0)
-			goto exit;
-		else if (!(file->f_flags & O_NONBLOCK))
-			goto retry;
-		rv = -EAGAIN;
-	}
-exit:
-	mutex_unlock(&dev->io_mutex);
+error_wq:
+	if (bot->wq)
+		destroy_workqueue(bot->wq);
+error_streams:
+	if (bot->uas)
+		usb_free_streams(interface, bot->uas_eps, 3, GFP_KERNEL);
 	return rv;
 }
 
-static void skel_write_bulk_callback(struct urb *urb)
+static void skel_bot_disconnect(struct usb_skel *dev)
 {
-	struct usb_skel *dev;
-
-	dev = urb->context;
-
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
-			err("%s - nonzero write bulk status received: %d",
-			    __func__, urb->status);
+	struct skel_bot *bot = dev->bot;
+	struct skel_lun *lun;
+	unsigned int i;
+
+	/* fail what is still queued, abort what is on the bus */
+	WRITE_ONCE(bot->dead, true);
+	skel_bot_abort(bot);
+	if (bot->uas) {
+		cancel_work_sync(&bot->reset_work);
+		usb_kill_anchored_urbs(&bot->uas_submitted);
+	}
 
-		spin_lock(&dev->err_lock);
-		dev->errors = urb->status;
-		spin_unlock(&dev->err_lock);
+	for (i = 0; i < bot->nr_luns; i++) {
+		lun = &bot->luns[i];
+		if (!lun->disk)
+			continue;
+		blk_mark_disk_dead(lun->disk);
+		del_gendisk(lun->disk);
+	}
+	if (bot->wq)
+		destroy_workqueue(bot->wq);
+	for (i = 0; i < bot->nr_luns; i++) {
+		lun = &bot->luns[i];
+		if (!lun->disk)
+			continue;
+		blk_mq_free_tag_set(&lun->tag_set);
+		put_disk(lun->disk);
 	}
+	if (bot->uas)
+		usb_free_streams(dev->interface, bot->uas_eps, 3, GFP_NOIO);
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&dev->limit_sem);
+	usb_autopm_put_interface_no_suspend(dev->interface);
 }
 
-static ssize_t skel_write(struct file *file, const char *user_buffer,
-			  size_t count, loff_t *ppos)
+/* after a reset the host controller has forgotten the streams */
+static void skel_bot_start(struct skel_bot *bot, bool reset)
 {
-	struct usb_skel *dev;
-	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	size_t writesize = min(count, (size_t)MAX_TRANSFER);
-
-	dev = file->private_data;
-
-	/* verify that we actually have some data to write */
-	if (count == 0)
-		goto exit;
-
-	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
-	 */
-	if (!(file->f_flags & O_NONBLOCK)) {
-		if (down_interruptible(&dev->limit_sem)) {
-			retval = -ERESTARTSYS;
-			goto exit;
-		}
-	} else {
-		if (down_trylock(&dev->limit_sem)) {
-			retval = -EAGAIN;
-			goto exit;
-		}
-	}
-
-	spin_lock_irq(&dev->err_lock);
-	retval = dev->errors;
-	if (retval < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		retval = (retval == -EPIPE) ? retval : -EIO;
-	}
-	spin_unlock_irq(&dev->err_lock);
-	if (retval < 0)
-		goto error;
+	unsigned int i;
+	int rv;
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
+	mutex_lock(&bot->mutex);
+	WRITE_ONCE(bot->stopped, false);
+	mutex_unlock(&bot->mutex);
 
-	buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+	if (bot->uas && reset) {
+		rv = usb_alloc_streams(bot->dev->interface, bot->uas_eps, 3,
+				       bot->streams, GFP_NOIO);
+		if (rv < 0)
+			dev_err(&bot->dev->udev->dev,
+				"%s - failed to get the streams back, error %d\n",
+				__func__, rv);
 	}
+	for (i = 0; i < bot->nr_luns; i++)
+		if (bot->luns[i].disk)
+			blk_mq_unquiesce_queue(bot->luns[i].disk->queue);
+}
 
-	if (copy_from_user(buf, user_buffer, writesize)) {
-		retval = -EFAULT;
-		goto error;
-	}
+/*
+ * Around suspend and reset: the queues are quiesced, so no command
+ * starts until skel_bot_start().  BOT commands already handed to the
+ * workqueue run to their end.  UAS commands still on the bus make
+ * suspend fail with -EBUSY, the device would go on holding their tags.
+ * A reset makes it forget them, so then they are taken off the bus and
+ * come back through the requeue list.
+ */
+static int skel_bot_stop(struct skel_bot *bot, bool reset)
+{
+	unsigned int i;
 
-	/* this lock makes sure we don't submit URBs to gone devices */
-	mutex_lock(&dev->io_mutex);
-	if (!dev->interface) {		/* disconnect() was called */
-		mutex_unlock(&dev->io_mutex);
-		retval = -ENODEV;
-		goto error;
-	}
+	for (i = 0; i < bot->nr_luns; i++)
+		if (bot->luns[i].disk)
+			blk_mq_quiesce_queue(bot->luns[i].disk->queue);
+	if (!bot->uas)
+		flush_workqueue(bot->wq);
 
-	/* initialize the urb properly */
-	usb_fill_bulk_urb(urb, dev->udev,
-			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-			  buf, writesize, skel_write_bulk_callback, dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &dev->submitted);
+	/* our own commands don't go through the queues, they fail meanwhile */
+	mutex_lock(&bot->mutex);
+	WRITE_ONCE(bot->stopped, true);
+	mutex_unlock(&bot->mutex);
 
-	/* send the data out the bulk port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&dev->io_mutex);
-	if (retval) {
-		err("%s - failed submitting write urb, error %d", __func__,
-		    retval);
-		goto error_unanchor;
+	if (!bot->uas)
+		return 0;
+	if (reset) {
+		usb_kill_anchored_urbs(&bot->uas_submitted);
+		return 0;
 	}
-
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
-
-
-	return writesize;
-
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-		usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-		usb_free_urb(urb);
+	if (!usb_wait_anchor_empty_timeout(&bot->uas_submitted, 1000)) {
+		skel_bot_start(bot, false);
+		return -EBUSY;
 	}
-	up(&dev->limit_sem);
-
-exit:
-	return retval;
+	return 0;
 }
 
-static const struct file_operations skel_fops = {
-	.owner =	THIS_MODULE,
-	.read =		skel_read,
-	.write =	skel_write,
-	.open =		skel_open,
-	.release =	skel_release,
-	.flush =	skel_flush,
-	.llseek =	noop_llseek,
-};
-
 /*
  * usb class driver info in order to get a minor number from the usb core,
  * and to have the device registered with the driver core
@@ -608,27 +4662,50 @@ static int skel_probe(struct usb_interface *interface,
 	int i;
 	int retval = -ENOMEM;
 
-	printk(KERN_INFO "==eric_prob==,vid= %04x, pid=%04x\n", USB_SKEL_VENDOR_ID, USB_SKEL_PRODUCT_ID );
-
 	// 一個新的skeleton
 	/* allocate memory for our device state and initialize it */
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev) {
-		err("Out of memory");
+		dev_err(&interface->dev, "Out of memory\n");
 		goto error;
 	}
-	
-	printk(KERN_ERR "devsize=%lx\n", sizeof(*dev));
-	printk(KERN_ERR "dev=%x\n", dev);
 
 	//初始化kref,把他設為1
 	//這個是本module的kref, 至於usbDevice的kref是在 dev->dev->kref
 	kref_init(&dev->kref);
-	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+	hrtimer_init(&dev->read_kick, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	dev->read_kick.function = skel_read_kick;
+	spin_lock_init(&dev->wwin.lock);
+	dev->wwin.size = WRITES_IN_FLIGHT;
+	dev->wwin.min = 1;
+	dev->wwin.max = WRITES_IN_FLIGHT_MAX;
+	dev->wwin.start = ktime_get();
 	mutex_init(&dev->io_mutex);
+	mutex_init(&dev->read_mutex);
 	spin_lock_init(&dev->err_lock);
+	spin_lock_init(&dev->read_lock);
+	spin_lock_init(&dev->write_pool_lock);
+	init_llist_head(&dev->write_bufs);
+	mutex_init(&dev->pending_mutex);
+	INIT_DELAYED_WORK(&dev->pending_work, skel_write_pending_expired);
+	INIT_LIST_HEAD(&dev->behind);
+	spin_lock_init(&dev->behind_lock);
+	mutex_init(&dev->behind_mutex);
+	INIT_WORK(&dev->behind_work, skel_write_behind_work);
+	init_llist_head(&dev->write_pool);
 	init_usb_anchor(&dev->submitted);
-	init_completion(&dev->bulk_in_completion);
+	init_usb_anchor(&dev->read_submitted);
+	init_waitqueue_head(&dev->bulk_in_wait);
+	init_waitqueue_head(&dev->bulk_out_wait);
+	init_waitqueue_head(&dev->aio_wait);
+	init_llist_head(&dev->dio_reap);
+	INIT_WORK(&dev->dio_work, skel_dio_reap);
+
+	dev->stats = alloc_percpu(struct skel_stats);
+	if (!dev->stats) {
+		dev_err(&interface->dev, "Out of memory\n");
+		goto error;
+	}
 
 	// 本來，要得到一個usb_device只要用interface_to_usbdev就夠了，
 	// 但因為要增加對該usb_device的引用計數，我們應該在做一個usb_get_dev的操作，
@@ -658,11 +4735,6 @@ static int skel_probe(struct usb_interface *interface,
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
 		endpoint = &iface_desc->endpoint[i].desc;
 
-		printk(KERN_ERR "dev->bulk_in_endpointAddr=%x\n", dev->bulk_in_endpointAddr);
-		printk(KERN_ERR "bNumEndpoints=%x\n", iface_desc->desc.bNumEndpoints);
-		printk(KERN_ERR "epNo=%d\n", i);
-		showEndPoint(endpoint);
-
 		// 把 device的endpoint descriptor，註冊到usb_skel中
 		// usb_endpoint_is_bulk_in 是檢查 是否為 8xh(bulkin) 與屬性 attribule是否為0x02(代表bulk傳輸)
 		if (!dev->bulk_in_endpointAddr &&
@@ -670,29 +4742,18 @@ static int skel_probe(struct usb_interface *interface,
 			/* we found a bulk in endpoint */
 
 			// 根據device 回報的最大package size，來決定使用多少memory
-			printk(KERN_ERR "We found bulkin\n");
-			
 			// usb_endpoint_maxp(endpoint) 其實就是 le16_to_cpu(epd->wMaxPacketSize);
 			// le16_to_cpu 是前後MSB轉LSB顛倒, big_endlian和little_endian互轉
 			buffer_size = usb_endpoint_maxp(endpoint);
-			dev->bulk_in_size = buffer_size;
+			dev->bulk_in_maxp = buffer_size;
 			dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
 
-			printk(KERN_ERR "buffer_size=%lx\n", buffer_size);
-			printk(KERN_ERR "bulk_in_endpointAddr=%x\n", dev->bulk_in_endpointAddr);
-
-			dev->bulk_in_buffer = kmalloc(buffer_size, GFP_KERNEL);
-			if (!dev->bulk_in_buffer) {
-				err("Could not allocate bulk_in_buffer");
-				goto error;
-			}
-
-			// 使用 usb_alloc_urb 建立一個 urb
-			// struct urb 可在include/linux/usb.h 找到
-			dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!dev->bulk_in_urb) {
-				err("Could not allocate bulk_in_urb");
-				goto error;
+			// 一個 urb 不再只讀一個 packet，而是 read_size 那麼多
+			// mass storage 不需要 ring，bulk-in 只收 data 與 CSW
+			if (!(id->driver_info & SKEL_BOT)) {
+				retval = skel_alloc_read_slots(dev, buffer_size);
+				if (retval)
+					goto error;
 			}
 		}
 
@@ -700,12 +4761,28 @@ static int skel_probe(struct usb_interface *interface,
 		    usb_endpoint_is_bulk_out(endpoint)) {
 			/* we found a bulk out endpoint */
 			dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
+			dev->bulk_out_maxp = usb_endpoint_maxp(endpoint);
 		}
 	}
 
 	//看看有沒有找到任何的bulk in /bulk out
 	if (!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr)) {
-		err("Could not find both bulk-in and bulk-out endpoints");
+		dev_err(&interface->dev,
+			"Could not find both bulk-in and bulk-out endpoints\n");
+		goto error;
+	}
+
+	/* mass storage gets a disk instead of /dev/skelN */
+	if (id->driver_info & SKEL_BOT) {
+		retval = skel_bot_probe(dev);
+		if (retval)
+			goto error;
+		return 0;
+	}
+
+	retval = skel_alloc_write_bufs(dev);
+	if (retval) {
+		dev_err(&interface->dev, "Could not allocate write buffers\n");
 		goto error;
 	}
 
@@ -724,11 +4801,17 @@ static int skel_probe(struct usb_interface *interface,
 	retval = usb_register_dev(interface, &skel_class);
 	if (retval) {
 		/* something prevented us from registering this driver */
-		err("Not able to get a minor for this device.");
+		dev_err(&interface->dev, "Not able to get a minor for this device.\n");
 		usb_set_intfdata(interface, NULL);
 		goto error;
 	}
 
+	dev->minor = interface->minor;
+	skel_debugfs_init(dev);
+	trace_skel_probe(dev->minor, dev->bulk_in_endpointAddr,
+			 dev->bulk_in_maxp, dev->bulk_out_endpointAddr,
+			 dev->bulk_out_maxp, dev->bulk_in_size, dev->read_nr);
+
 	/* let the user know what node this device is now attached to */
 	dev_info(&interface->dev,
 		 "USB Skeleton device now attached to USBSkel-%d",
@@ -744,9 +4827,7 @@ error:
 
 static void skel_disconnect(struct usb_interface *interface)
 {
-	printk(KERN_ERR "==eric_disconnect==\n");
 	struct usb_skel *dev;
-	
 	int minor = interface->minor;
 
 	//取出該interface所對應的 usb_skel( 該usb_skel在 probe階段被設定到interface上)
@@ -757,45 +4838,91 @@ static void skel_disconnect(struct usb_interface *interface)
 
 	/* give back our minor */
 	//註銷這個interface所綁定的 skel_class
-	usb_deregister_dev(interface, &skel_class);
+	if (dev->bot)
+		skel_bot_disconnect(dev);
+	else
+		usb_deregister_dev(interface, &skel_class);
+	/* waits for anybody still reading the files */
+	debugfs_remove_recursive(dev->debugfs);
 
 	/* prevent more I/O from starting */
 	mutex_lock(&dev->io_mutex);
+	spin_lock_irq(&dev->read_lock);
 	dev->interface = NULL;
+	spin_unlock_irq(&dev->read_lock);
 	mutex_unlock(&dev->io_mutex);
 
 	usb_kill_anchored_urbs(&dev->submitted);
+	/* a buffer still collecting writes is dropped, so is the queue */
+	skel_write_flush_pending(dev);
+	skel_write_behind_run(dev);
+	skel_read_stop(dev);
+	/* pollers see the hangup */
+	wake_up_interruptible(&dev->bulk_out_wait);
+	/* the killed AIO transfers are freed before the module can go */
+	flush_work(&dev->dio_work);
+
+	trace_skel_disconnect(minor);
 
 	/* decrement our usage count */
 	//把kref引用計數減1，如果到0時，會呼叫skel_delete
-	printk(KERN_INFO "eric_dev->kref = %d \n", dev->kref.refcount);
 	kref_put(&dev->kref, skel_delete);
 
 	dev_info(&interface->dev, "USB Skeleton #%d now disconnected", minor);
 }
 
-static void skel_draw_down(struct usb_skel *dev)
+/* returns -EIO if writes still in flight had to be killed */
+static int skel_draw_down(struct usb_skel *dev)
 {
 	int time;
 
 	time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
-	if (!time)
+	if (!time) {
 		usb_kill_anchored_urbs(&dev->submitted);
-	usb_kill_urb(dev->bulk_in_urb);
+		return -EIO;
+	}
+	return 0;
 }
 
 static int skel_suspend(struct usb_interface *intf, pm_message_t message)
 {
 	struct usb_skel *dev = usb_get_intfdata(intf);
+	int rv;
 
 	if (!dev)
 		return 0;
+	/* no mass-storage command until we are resumed */
+	if (dev->bot) {
+		rv = skel_bot_stop(dev->bot, false);
+		if (rv)
+			return rv;
+	}
+	skel_write_flush_pending(dev);
 	skel_draw_down(dev);
+	skel_read_stop(dev);
 	return 0;
 }
 
 static int skel_resume(struct usb_interface *intf)
 {
+	struct usb_skel *dev = usb_get_intfdata(intf);
+
+	if (dev && dev->bot)
+		skel_bot_start(dev->bot, false);
+	return 0;
+}
+
+/* the device lost its state while suspended */
+static int skel_reset_resume(struct usb_interface *intf)
+{
+	struct usb_skel *dev = usb_get_intfdata(intf);
+
+	if (!dev)
+		return 0;
+	if (dev->bot)
+		skel_bot_start(dev->bot, true);
+	else
+		dev->errors = -EPIPE;
 	return 0;
 }
 
@@ -804,7 +4931,13 @@ static int skel_pre_reset(struct usb_interface *intf)
 	struct usb_skel *dev = usb_get_intfdata(intf);
 
 	mutex_lock(&dev->io_mutex);
+	if (dev->bot)
+		skel_bot_stop(dev->bot, true);
 	skel_draw_down(dev);
+	skel_read_halt(dev);
+	/* readers woke up with an error, keep them out until post_reset */
+	mutex_lock(&dev->read_mutex);
+	skel_read_reset(dev);
 
 	return 0;
 }
@@ -815,20 +4948,124 @@ static int skel_post_reset(struct usb_interface *intf)
 
 	/* we are sure no URBs are active - no locking needed */
 	dev->errors = -EPIPE;
+	mutex_unlock(&dev->read_mutex);
+	if (dev->bot)
+		skel_bot_start(dev->bot, true);
 	mutex_unlock(&dev->io_mutex);
 
 	return 0;
 }
 
+/*
+ * Bounds of the write window, per device in the interface's sysfs
+ * directory.  Changing them pulls the window inside at once.
+ */
+static ssize_t skel_window_bound_store(struct device *d, const char *buf,
+				       size_t count, bool upper)
+{
+	struct usb_skel *dev = usb_get_intfdata(to_usb_interface(d));
+	struct skel_write_window *w = &dev->wwin;
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	if (val < 1 || val > WRITES_IN_FLIGHT_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&w->lock);
+	if (upper ? val < w->min : val > w->max) {
+		spin_unlock_irq(&w->lock);
+		return -EINVAL;
+	}
+	if (upper)
+		w->max = val;
+	else
+		w->min = val;
+	w->size = clamp(w->size, w->min, w->max);
+	spin_unlock_irq(&w->lock);
+
+	/* a larger window lets waiting writers go */
+	wake_up_interruptible_poll(&dev->bulk_out_wait, EPOLLOUT | EPOLLWRNORM);
+	return count;
+}
+
+static ssize_t write_window_show(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_skel *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev->wwin.size));
+}
+static DEVICE_ATTR_RO(write_window);
+
+static ssize_t write_window_min_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	struct usb_skel *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev->wwin.min));
+}
+
+static ssize_t write_window_min_store(struct device *d,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	return skel_window_bound_store(d, buf, count, false);
+}
+static DEVICE_ATTR_RW(write_window_min);
+
+static ssize_t write_window_max_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	struct usb_skel *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev->wwin.max));
+}
+
+static ssize_t write_window_max_store(struct device *d,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	return skel_window_bound_store(d, buf, count, true);
+}
+static DEVICE_ATTR_RW(write_window_max);
+
+static struct attribute *skel_attrs[] = {
+	&dev_attr_write_window.attr,
+	&dev_attr_write_window_min.attr,
+	&dev_attr_write_window_max.attr,
+	NULL
+};
+
+/* mass storage has no write window */
+static umode_t skel_attr_is_visible(struct kobject *kobj,
+				    struct attribute *attr, int n)
+{
+	struct usb_interface *intf = to_usb_interface(kobj_to_dev(kobj));
+	struct usb_skel *dev = usb_get_intfdata(intf);
+
+	return dev && !dev->bot ? attr->mode : 0;
+}
+
+static const struct attribute_group skel_group = {
+	.attrs =	skel_attrs,
+	.is_visible =	skel_attr_is_visible,
+};
+__ATTRIBUTE_GROUPS(skel);
+
 static struct usb_driver skel_driver = {
 	.name =		"skeleton",
 	.probe =	skel_probe,
 	.disconnect =	skel_disconnect,
 	.suspend =	skel_suspend,
 	.resume =	skel_resume,
+	.reset_resume =	skel_reset_resume,
 	.pre_reset =	skel_pre_reset,
 	.post_reset =	skel_post_reset,
 	.id_table =	skel_table,
+	.dev_groups =	skel_groups,
 	.supports_autosuspend = 1,
 };
 
@@ -836,10 +5073,14 @@ static int __init usb_skel_init(void)
 {
 	int result;
 
+	skel_debugfs_root = debugfs_create_dir("eric_usb", NULL);
+
 	/* register this driver with the USB subsystem */
 	result = usb_register(&skel_driver);
-	if (result)
-		err("usb_register failed. Error number %d", result);
+	if (result) {
+		pr_err("usb_register failed. Error number %d\n", result);
+		debugfs_remove_recursive(skel_debugfs_root);
+	}
 
 	return result;
 }
@@ -848,6 +5089,7 @@ static void __exit usb_skel_exit(void)
 {
 	/* deregister this driver with the USB subsystem */
 	usb_deregister(&skel_driver);
+	debugfs_remove_recursive(skel_debugfs_root);
 }
 
 module_init(usb_skel_init);
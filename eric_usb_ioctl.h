@@ -0,0 +1,69 @@
+/*
+ * Interface between eric_usb_driver and user space
+ *
+ * Shared by the driver and by the programs using /dev/skelN, so keep
+ * it free of kernel only types.
+ */
+
+#ifndef __ERIC_USB_IOCTL_H
+#define __ERIC_USB_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * mmap() receive ring
+ *
+ * Offset 0 of the mapping is a control page, the data of slot i starts
+ * at data_offset + i * slot_stride.  The driver advances head after it
+ * has filled a slot, the application advances tail after it is done
+ * with one.  Slots in [tail, head) belong to the application, all
+ * others to the driver.  Both counters run freely, use them modulo
+ * nr_slots.  Map one page first to learn the size of the whole ring.
+ */
+struct skel_ring_slot {
+	__u32	len;		/* bytes the device sent into this slot */
+	__s32	status;		/* 0 or the negative urb status */
+};
+
+struct skel_ring_ctrl {
+	__u32	nr_slots;	/* slots in the ring */
+	__u32	slot_size;	/* bytes one transfer may fill */
+	__u32	slot_stride;	/* distance between two slots in the mapping */
+	__u32	data_offset;	/* where slot 0 starts in the mapping */
+	__u32	head;		/* slots filled, written by the driver */
+	__u32	tail;		/* slots released, written by the application */
+	__u32	reserved[2];
+	struct skel_ring_slot slot[];
+};
+
+#define SKEL_IOC_MAGIC		'E'
+
+/* sleep until the ring holds data, hands released slots back first */
+#define SKEL_IOC_RING_WAIT	_IO(SKEL_IOC_MAGIC, 1)
+
+/*
+ * Message mode, per open file
+ *
+ * In SKEL_MODE_MSG every write() goes out as exactly one bulk transfer,
+ * ended with a zero length packet where the length alone wouldn't end
+ * it, or fails with EMSGSIZE if it can't.  Every read() returns the
+ * data of exactly one completed bulk-in urb; what doesn't fit into the
+ * caller's buffer is dropped.  Empty transfers aren't returned.
+ * SKEL_IOC_MSG_INFO tells what happened to the last message read.
+ */
+#define SKEL_MODE_STREAM	0	/* byte stream, the default */
+#define SKEL_MODE_MSG		1	/* one read() or write() per transfer */
+
+#define SKEL_MSG_TRUNC		(1 << 0)	/* the buffer was too small */
+#define SKEL_MSG_MORE		(1 << 1)	/* it filled a whole urb or was cut short, the transfer may go on */
+
+struct skel_msg_info {
+	__u32	len;		/* bytes the device sent */
+	__u32	flags;		/* SKEL_MSG_* */
+};
+
+#define SKEL_IOC_SET_MODE	_IOW(SKEL_IOC_MAGIC, 2, __u32)
+#define SKEL_IOC_MSG_INFO	_IOR(SKEL_IOC_MAGIC, 3, struct skel_msg_info)
+
+#endif /* __ERIC_USB_IOCTL_H */
@@ -0,0 +1,197 @@
+/*
+ * Tracepoints for eric_usb_driver
+ *
+ * Enable them with perf, trace-cmd or bpftrace under the eric_usb
+ * system, e.g. "trace-cmd record -e eric_usb".  minor is the N of
+ * /dev/skelN, ep the endpoint address with the direction bit.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eric_usb
+
+#if !defined(_ERIC_USB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ERIC_USB_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+#define skel_urb_ep(urb) \
+	(usb_pipeendpoint((urb)->pipe) | \
+	 (usb_pipein((urb)->pipe) ? USB_DIR_IN : 0))
+
+TRACE_EVENT(skel_probe,
+	TP_PROTO(int minor, u8 in_ep, size_t in_maxp, u8 out_ep,
+		 size_t out_maxp, size_t in_size, unsigned int in_nr),
+	TP_ARGS(minor, in_ep, in_maxp, out_ep, out_maxp, in_size, in_nr),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(u8,		in_ep)
+		__field(u8,		out_ep)
+		__field(u32,		in_maxp)
+		__field(u32,		out_maxp)
+		__field(u32,		in_size)
+		__field(u32,		in_nr)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->in_ep = in_ep;
+		__entry->out_ep = out_ep;
+		__entry->in_maxp = in_maxp;
+		__entry->out_maxp = out_maxp;
+		__entry->in_size = in_size;
+		__entry->in_nr = in_nr;
+	),
+
+	TP_printk("skel%d in ep%02x maxp %u, %u urbs of %u bytes, out ep%02x maxp %u",
+		  __entry->minor, __entry->in_ep, __entry->in_maxp,
+		  __entry->in_nr, __entry->in_size, __entry->out_ep,
+		  __entry->out_maxp)
+);
+
+TRACE_EVENT(skel_disconnect,
+	TP_PROTO(int minor),
+	TP_ARGS(minor),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+
+	TP_printk("skel%d", __entry->minor)
+);
+
+TRACE_EVENT(skel_open,
+	TP_PROTO(int minor, int ret),
+	TP_ARGS(minor, ret),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ret = ret;
+	),
+
+	TP_printk("skel%d ret %d", __entry->minor, __entry->ret)
+);
+
+/* one read() or write() style call, ret is what the caller got back */
+DECLARE_EVENT_CLASS(skel_io,
+	TP_PROTO(int minor, size_t count, int ki_flags, ssize_t ret),
+	TP_ARGS(minor, count, ki_flags, ret),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(size_t,		count)
+		__field(int,		ki_flags)
+		__field(ssize_t,	ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->ki_flags = ki_flags;
+		__entry->ret = ret;
+	),
+
+	TP_printk("skel%d count %zu ki_flags 0x%x ret %zd",
+		  __entry->minor, __entry->count, __entry->ki_flags,
+		  __entry->ret)
+);
+
+DEFINE_EVENT(skel_io, skel_read,
+	TP_PROTO(int minor, size_t count, int ki_flags, ssize_t ret),
+	TP_ARGS(minor, count, ki_flags, ret)
+);
+
+DEFINE_EVENT(skel_io, skel_write,
+	TP_PROTO(int minor, size_t count, int ki_flags, ssize_t ret),
+	TP_ARGS(minor, count, ki_flags, ret)
+);
+
+/*
+ * One urb going to or coming back from the host controller.  depth is
+ * the number of transfers the driver has outstanding in that direction
+ * (ring urbs for bulk-in, writes in flight for bulk-out, asynchronous
+ * transfers for AIO), this one included.
+ */
+DECLARE_EVENT_CLASS(skel_urb,
+	TP_PROTO(int minor, struct urb *urb, unsigned int depth),
+	TP_ARGS(minor, urb, depth),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(const void *,	urb)
+		__field(u8,		ep)
+		__field(u32,		length)
+		__field(u32,		actual)
+		__field(int,		status)
+		__field(int,		num_sgs)
+		__field(unsigned int,	depth)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->urb = urb;
+		__entry->ep = skel_urb_ep(urb);
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual = urb->actual_length;
+		__entry->status = urb->status;
+		__entry->num_sgs = urb->num_sgs;
+		__entry->depth = depth;
+	),
+
+	TP_printk("skel%d urb %p ep%02x length %u actual %u status %d sgs %d depth %u",
+		  __entry->minor, __entry->urb, __entry->ep, __entry->length,
+		  __entry->actual, __entry->status, __entry->num_sgs,
+		  __entry->depth)
+);
+
+DEFINE_EVENT(skel_urb, skel_urb_submit,
+	TP_PROTO(int minor, struct urb *urb, unsigned int depth),
+	TP_ARGS(minor, urb, depth)
+);
+
+DEFINE_EVENT(skel_urb, skel_urb_complete,
+	TP_PROTO(int minor, struct urb *urb, unsigned int depth),
+	TP_ARGS(minor, urb, depth)
+);
+
+/* a failed submission or a completion status that isn't an unlink */
+TRACE_EVENT(skel_urb_error,
+	TP_PROTO(int minor, struct urb *urb, int error),
+	TP_ARGS(minor, urb, error),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(const void *,	urb)
+		__field(u8,		ep)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->urb = urb;
+		__entry->ep = skel_urb_ep(urb);
+		__entry->error = error;
+	),
+
+	TP_printk("skel%d urb %p ep%02x error %d", __entry->minor,
+		  __entry->urb, __entry->ep, __entry->error)
+);
+
+#endif /* _ERIC_USB_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eric_usb_trace
+#include <trace/define_trace.h>
@@ -1 +1 @@
-mount -v -t auto /dev/skel0 /mnt/myusb
+mount -v -t auto /dev/skelb0 /mnt/myusb